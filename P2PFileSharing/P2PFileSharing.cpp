@@ -2,12 +2,66 @@
 #include "server.h"
 #include "tracker_client.h"
 #include "leecher.h"
+#include "download_manager.h"
+#include "download_state.h"
+#include "manifest.h"
+#include "buffer_pool.h"
 #include "http_ui.h"
 #include "utilities.h"
+#include "file_transfer.h"
+#include "logger.h"
+
+
+
+int main(int argc, char* argv[]) {
+    // Optional knobs:
+    //   --server-threads N  (0 = one per hardware thread)
+    //   --pipeline-depth N  (outstanding chunk requests per peer, 0 = auto)
+    //   --connections N     (peer connections per download, 0 = auto)
+    //   --max-connections N (peer connections over all downloads, default 128)
+    //   --max-active-downloads N (downloads running at once, default 3; the rest queue)
+    //   --leecher-threads N (threads driving all downloads' connections)
+    //   --no-sendfile       (serve through a userspace buffer instead of sendfile)
+    //   --no-endgame        (don't duplicate the last in-flight chunks across peers)
+    //   --chunk-cache-mb N  (RAM for hot chunks on the seeding side, 0 = off)
+    //   --buffer-pool-mb N  (hard cap on chunk buffers in flight, default 128)
+    //   --upload-slots N    (peers served at once, 0 = unlimited)
+    //   --max-upload N, --max-download N  (global limits in KB/s, 0 = unlimited)
+    //   --log-level L       (debug, info, warn, error or off; debug logs every chunk)
+    //   --sync P            (when downloads hit the disk: none, periodic or chunk)
+    //   --sync-every-mb N   (periodic sync interval, default 64)
+    size_t server_threads = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--server-threads" && has_value) server_threads = std::stoul(argv[++i]);
+        else if (arg == "--pipeline-depth" && has_value) leecher_pipeline_depth = std::stoul(argv[++i]);
+        else if (arg == "--connections" && has_value) leecher_connections = std::stoul(argv[++i]);
+        else if (arg == "--max-connections" && has_value) leecher_max_connections = std::max(1ul, std::stoul(argv[++i]));
+        else if (arg == "--max-active-downloads" && has_value) download_manager.set_max_active(std::stoul(argv[++i]));
+        else if (arg == "--leecher-threads" && has_value) leecher_threads = std::stoul(argv[++i]);
+        else if (arg == "--no-sendfile") zero_copy_enabled = false;
+        else if (arg == "--no-endgame") leecher_endgame = false;
+        else if (arg == "--chunk-cache-mb" && has_value) chunk_cache.set_capacity(std::stoul(argv[++i]) * 1024 * 1024);
+        else if (arg == "--buffer-pool-mb" && has_value) buffer_pool.set_capacity(std::stoul(argv[++i]) * 1024 * 1024);
+        else if (arg == "--upload-slots" && has_value) upload_slots.set_max_unchoked(std::stoul(argv[++i]));
+        else if (arg == "--max-upload" && has_value) rate_limits.global_upload = std::stoull(argv[++i]) * 1024;
+        else if (arg == "--max-download" && has_value) rate_limits.global_download = std::stoull(argv[++i]) * 1024;
+        else if (arg == "--log-level" && has_value) {
+            LogLevel level;
+            if (logger::parse_level(argv[++i], level)) logger::level = level;
+            else std::cerr << "Unknown log level: " << argv[i] << "\n";
+        }
+        else if (arg == "--sync" && has_value) {
+            std::string policy = argv[++i];
+            if (policy == "none") leecher_sync_policy = SyncPolicy::None;
+            else if (policy == "periodic") leecher_sync_policy = SyncPolicy::Periodic;
+            else if (policy == "chunk") leecher_sync_policy = SyncPolicy::EveryChunk;
+            else std::cerr << "Unknown sync policy: " << policy << "\n";
+        }
+        else if (arg == "--sync-every-mb" && has_value) leecher_sync_bytes = std::stoull(argv[++i]) * 1024 * 1024;
+    }
 
-
-
-int main() {
     // Detect environment
     std::string tracker_ip = "127.0.0.1";
     unsigned short tracker_port = 8000;
@@ -23,7 +77,7 @@ int main() {
     catch (...) {}
 
     // Start P2P server socket concurrently
-    std::thread server_thread([&]() { run_server(p2p_port); });
+    std::thread server_thread([&]() { run_server(p2p_port, server_threads); });
 
     // Start HTTP UI
     httplib::Server http;
@@ -37,14 +91,19 @@ int main() {
     std::cout << "HTTP UI running at http://" << local_ip << ":" << http_port << "\n";
     std::cout << "P2P server running on port " << p2p_port << "\n";
 
+    // Pick up downloads a previous run didn't finish. Asking the tracker
+    // for peers can block, so the prompt doesn't wait for it.
+    std::thread([=]() { resume_downloads(p2p_port, tracker_ip, tracker_port); }).detach();
+
     // Handle command-line interface as well
     std::string command;
     while (true) {
         std::cout << "\nCommands:\n";
         std::cout << "1. share <filename> - Share a file\n";
-        std::cout << "2. download <filename> [saveas] - Download a file\n";
-        std::cout << "3. list - List downloaded files\n";
-        std::cout << "4. exit - Exit the program\n";
+        std::cout << "2. download <filename> [saveas] [low|normal|high] - Download a file\n";
+        std::cout << "3. pause <saveas> / resume <saveas> - Pause or resume a download\n";
+        std::cout << "4. list - List downloaded files\n";
+        std::cout << "5. exit - Exit the program\n";
         std::cout << "> ";
 
         std::getline(std::cin, command);
@@ -72,19 +131,34 @@ int main() {
                 std::filesystem::copy_options::overwrite_existing
             );
 
+            auto manifest = make_manifest("shared_files/" + basename);
+            if (!manifest) {
+                std::cout << "Error: Could not hash file\n";
+                continue;
+            }
+            std::cout << "Manifest: " << manifest->chunks() << " chunks, root "
+                << to_hex(manifest->root.data(), manifest->root.size()) << "\n";
+
             bool success = register_with_retry(tracker_ip, tracker_port, basename, local_ip, p2p_port);
             std::cout << (success ? "File registered successfully\n" : "Failed to register file\n");
         }
         else if (cmd == "download") {
-            std::string filename, saveas;
+            std::string filename, saveas, priority_arg;
             iss >> filename;
             iss >> saveas;
+            iss >> priority_arg;
 
             if (filename.empty()) {
                 std::cout << "Error: No filename provided\n";
                 continue;
             }
 
+            Priority priority;
+            if (!parse_priority(priority_arg, priority)) {
+                std::cout << "Error: Unknown priority " << priority_arg << "\n";
+                continue;
+            }
+
             if (saveas.empty()) saveas = filename;
 
             auto peers = get_peers_from_tracker(tracker_ip, tracker_port, filename);
@@ -93,17 +167,24 @@ int main() {
                 continue;
             }
 
-            std::thread download_thread([peers, filename, saveas, p2p_port, tracker_ip, tracker_port]() {
-                run_leecher_parallel(peers, filename, saveas, p2p_port, tracker_ip, tracker_port);
-                });
-            download_thread.detach();
-            std::cout << "Download started for " << filename << "\n";
+            if (!download_manager.add(peers, filename, saveas, p2p_port, tracker_ip, tracker_port, priority)) {
+                std::cout << "Error: " << saveas << " is already queued\n";
+                continue;
+            }
+            std::cout << "Download queued for " << filename << "\n";
+        }
+        else if (cmd == "pause" || cmd == "resume") {
+            std::string saveas;
+            iss >> saveas;
+            bool ok = cmd == "pause" ? download_manager.pause(saveas) : download_manager.resume(saveas);
+            if (!ok && cmd == "resume") ok = download_manager.add_saved(saveas, p2p_port, tracker_ip, tracker_port);
+            std::cout << (ok ? "OK\n" : "Error: No such download to " + cmd + "\n");
         }
         else if (cmd == "list") {
             std::cout << "Downloaded files:\n";
             try {
                 for (const auto& entry : std::filesystem::directory_iterator("downloads")) {
-                    if (entry.is_regular_file()) {
+                    if (entry.is_regular_file() && !is_state_file(entry.path()) && !is_manifest_file(entry.path())) {
                         std::cout << "- " << entry.path().filename().string()
                             << " (" << entry.file_size() << " bytes)\n";
                     }
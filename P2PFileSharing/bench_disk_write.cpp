@@ -0,0 +1,134 @@
+// File: P2PFileSharing/bench_disk_write.cpp
+//
+// Measures how fast concurrent writers get received chunks onto disk: the
+// old path (one std::ofstream behind a mutex, seekp + write + flush per
+// chunk) against a preallocated OutputFile written with lock-free positional
+// writes. Chunks go out in shuffled order, as they arrive from a swarm.
+// Usage: bench_disk_write [size_mb=512] [writers...=8 32]
+
+#include "common.h"
+#include "file_transfer.h"
+#include <iomanip>
+#include <random>
+
+using bench_clock = std::chrono::steady_clock;
+
+struct Result
+{
+    double write_s;  // until every writer is done
+    double total_s;  // including the final sync
+};
+
+// Hands out chunk indices from a shared shuffled list
+struct ChunkQueue
+{
+    std::vector<size_t> order;
+    std::atomic<size_t> next{ 0 };
+
+    bool pop(size_t& idx)
+    {
+        size_t i = next.fetch_add(1, std::memory_order_relaxed);
+        if (i >= order.size()) return false;
+        idx = order[i];
+        return true;
+    }
+};
+
+template <typename WriteChunk>
+static double run_writers(size_t writers, ChunkQueue& queue, WriteChunk write_chunk)
+{
+    std::vector<char> chunk(CHUNK_SIZE);
+    for (size_t i = 0; i < chunk.size(); ++i) chunk[i] = static_cast<char>(i * 131 + 7);
+
+    auto start = bench_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < writers; ++w) {
+        threads.emplace_back([&]() {
+            size_t idx;
+            while (queue.pop(idx)) write_chunk(idx, chunk.data());
+        });
+    }
+    for (auto& t : threads) t.join();
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static Result bench_stream(const std::string& path, uint64_t size, size_t writers, ChunkQueue& queue)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    std::mutex file_mutex;
+    Result r;
+    r.write_s = run_writers(writers, queue, [&](size_t idx, const char* data) {
+        uint64_t offset = static_cast<uint64_t>(idx) * CHUNK_SIZE;
+        size_t len = static_cast<size_t>(std::min<uint64_t>(CHUNK_SIZE, size - offset));
+        std::lock_guard lk(file_mutex);
+        out.seekp(offset);
+        out.write(data, len);
+        out.flush();
+    });
+    auto sync_start = bench_clock::now();
+    out.close();
+    OutputFile file;
+    file.open(path, size, true);
+    file.sync();
+    r.total_s = r.write_s + std::chrono::duration<double>(bench_clock::now() - sync_start).count();
+    return r;
+}
+
+static Result bench_pwrite(const std::string& path, uint64_t size, size_t writers, ChunkQueue& queue)
+{
+    auto start = bench_clock::now();
+    OutputFile file;
+    if (!file.open(path, size, false)) {
+        std::cerr << "could not open " << path << "\n";
+        return { 0, 0 };
+    }
+    double prealloc_s = std::chrono::duration<double>(bench_clock::now() - start).count();
+    Result r;
+    r.write_s = prealloc_s + run_writers(writers, queue, [&](size_t idx, const char* data) {
+        uint64_t offset = static_cast<uint64_t>(idx) * CHUNK_SIZE;
+        size_t len = static_cast<size_t>(std::min<uint64_t>(CHUNK_SIZE, size - offset));
+        file.write_at(data, len, offset);
+    });
+    auto sync_start = bench_clock::now();
+    file.sync();
+    r.total_s = r.write_s + std::chrono::duration<double>(bench_clock::now() - sync_start).count();
+    return r;
+}
+
+int main(int argc, char* argv[])
+{
+    uint64_t size_mb = argc > 1 ? std::stoull(argv[1]) : 512;
+    std::vector<size_t> writer_counts;
+    for (int i = 2; i < argc; ++i) writer_counts.push_back(std::stoul(argv[i]));
+    if (writer_counts.empty()) writer_counts = { 8, 32 };
+
+    uint64_t size = size_mb * 1024 * 1024;
+    size_t total_chunks = static_cast<size_t>((size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    const std::string path = "bench_disk_write.tmp";
+
+    std::mt19937 rng(42);
+    ChunkQueue queue;
+    queue.order.resize(total_chunks);
+    for (size_t i = 0; i < total_chunks; ++i) queue.order[i] = i;
+    std::shuffle(queue.order.begin(), queue.order.end(), rng);
+
+    std::cout << std::left << std::setw(10) << "path" << std::setw(10) << "writers"
+        << std::setw(12) << "MB" << std::setw(14) << "write MB/s" << "with sync MB/s\n";
+
+    for (size_t writers : writer_counts) {
+        for (bool positional : { false, true }) {
+            std::filesystem::remove(path);
+            queue.next = 0;
+            Result r = positional ? bench_pwrite(path, size, writers, queue)
+                                  : bench_stream(path, size, writers, queue);
+            double mb = static_cast<double>(size) / (1024.0 * 1024.0);
+            std::cout << std::left << std::setw(10) << (positional ? "pwrite" : "ofstream")
+                << std::setw(10) << writers << std::setw(12) << mb
+                << std::setw(14) << std::fixed << std::setprecision(0) << mb / r.write_s
+                << mb / r.total_s << "\n";
+        }
+    }
+
+    std::filesystem::remove(path);
+    return 0;
+}
@@ -0,0 +1,126 @@
+// File: P2PFileSharing/bench_sendfile.cpp
+//
+// Compares the CPU cost of serving chunks through a userspace buffer with
+// the sendfile() path. Usage: bench_sendfile [size_mb=256] [rounds=4]
+
+#include "common.h"
+#include "file_transfer.h"
+#include <iomanip>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// CPU seconds (user + system) consumed so far by the calling thread
+static double thread_cpu_seconds()
+{
+#ifdef _WIN32
+    FILETIME create, exit, kernel, user;
+    GetThreadTimes(GetCurrentThread(), &create, &exit, &kernel, &user);
+    auto to_sec = [](const FILETIME& ft) {
+        return ((static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime) / 1e7;
+    };
+    return to_sec(kernel) + to_sec(user);
+#else
+    struct rusage ru;
+#ifdef RUSAGE_THREAD
+    getrusage(RUSAGE_THREAD, &ru);
+#else
+    getrusage(RUSAGE_SELF, &ru);
+#endif
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+#endif
+}
+
+// Serves the file chunk by chunk, the way SENDCHUNK does, `rounds` times
+static void serve_chunks(boost::asio::io_context& io, tcp::socket& sock,
+    const FileHandle& file, uint64_t size, int rounds)
+{
+    size_t total_chunks = static_cast<size_t>((size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    size_t remaining = total_chunks * rounds;
+    size_t idx = 0;
+
+    std::function<void()> next = [&]() {
+        if (remaining == 0) return;
+        --remaining;
+        uint64_t offset = static_cast<uint64_t>(idx) * CHUNK_SIZE;
+        size_t len = static_cast<size_t>(std::min<uint64_t>(CHUNK_SIZE, size - offset));
+        idx = (idx + 1) % total_chunks;
+        async_send_file_range(sock, file, offset, len,
+            [&](const boost::system::error_code& ec, size_t) {
+                if (ec) {
+                    std::cerr << "send failed: " << ec.message() << "\n";
+                    return;
+                }
+                next();
+            });
+    };
+
+    next();
+    io.run();
+    io.restart();
+}
+
+int main(int argc, char* argv[])
+{
+    uint64_t size_mb = argc > 1 ? std::stoull(argv[1]) : 256;
+    int rounds = argc > 2 ? std::stoi(argv[2]) : 4;
+    uint64_t size = size_mb * 1024 * 1024;
+    const std::string path = "bench_sendfile.tmp";
+
+    // Build the test file and leave it in the page cache
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        std::vector<char> block(CHUNK_SIZE);
+        for (size_t i = 0; i < block.size(); ++i) block[i] = static_cast<char>(i * 131 + 7);
+        for (uint64_t written = 0; written < size; written += block.size())
+            out.write(block.data(), static_cast<std::streamsize>(std::min<uint64_t>(block.size(), size - written)));
+    }
+
+    boost::asio::io_context io;
+    tcp::acceptor acceptor(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    tcp::socket client(io), server(io);
+    client.connect(acceptor.local_endpoint());
+    acceptor.accept(server);
+
+    // The receiving side only drains the socket
+    std::thread sink([&client]() {
+        std::vector<char> buf(1024 * 1024);
+        boost::system::error_code ec;
+        while (!ec) client.read_some(boost::asio::buffer(buf), ec);
+    });
+
+    FileHandle file(path);
+    double gb = static_cast<double>(size) * rounds / (1024.0 * 1024.0 * 1024.0);
+
+    std::cout << std::left << std::setw(10) << "path" << std::setw(12) << "GB"
+        << std::setw(12) << "wall s" << std::setw(12) << "MB/s"
+        << std::setw(12) << "CPU s" << "CPU s/GB\n";
+
+    for (bool zero_copy : { false, true }) {
+        zero_copy_enabled = zero_copy;
+        serve_chunks(io, server, file, size, 1);  // warm-up
+
+        auto wall_start = std::chrono::steady_clock::now();
+        double cpu_start = thread_cpu_seconds();
+        serve_chunks(io, server, file, size, rounds);
+        double cpu = thread_cpu_seconds() - cpu_start;
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+        std::cout << std::left << std::setw(10) << (zero_copy ? "sendfile" : "buffered")
+            << std::setw(12) << gb << std::setw(12) << wall
+            << std::setw(12) << (gb * 1024.0 / wall)
+            << std::setw(12) << cpu << (cpu / gb) << "\n";
+    }
+
+    boost::system::error_code ec;
+    server.shutdown(tcp::socket::shutdown_both, ec);
+    server.close(ec);
+    sink.join();
+    file = FileHandle();
+    std::filesystem::remove(path);
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include "buffer_pool.h"
+#include <new>
+
+BufferPool& buffer_pool = *new BufferPool(128 * 1024 * 1024);
+
+PooledBuffer::~PooledBuffer()
+{
+    if (data_) pool_->release(data_);
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept : pool_(other.pool_), data_(other.data_)
+{
+    other.data_ = nullptr;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept
+{
+    if (this != &other) {
+        if (data_) pool_->release(data_);
+        pool_ = other.pool_;
+        data_ = other.data_;
+        other.data_ = nullptr;
+    }
+    return *this;
+}
+
+BufferPool::BufferPool(size_t capacity_bytes) : capacity_(capacity_bytes)
+{
+}
+
+char* BufferPool::take_locked()
+{
+    char* data = nullptr;
+    if (!free_.empty()) {
+        data = free_.back();
+        free_.pop_back();
+    }
+    else if (allocated_ < max_buffers()) {
+        // Uninitialized on purpose: every byte is overwritten before it is read
+        data = static_cast<char*>(::operator new(CHUNK_SIZE, std::align_val_t(ALIGNMENT)));
+        ++allocated_;
+        ++allocations_;
+    }
+    else {
+        return nullptr;
+    }
+    ++acquires_;
+    peak_in_use_ = std::max(peak_in_use_, ++in_use_);
+    return data;
+}
+
+PooledBuffer BufferPool::try_acquire()
+{
+    std::lock_guard lk(mutex_);
+    char* data = take_locked();
+    return data ? PooledBuffer(this, data) : PooledBuffer();
+}
+
+void BufferPool::async_acquire(const boost::asio::any_io_executor& ex, Handler handler)
+{
+    std::unique_lock lk(mutex_);
+    char* data = take_locked();
+    if (!data) {
+        ++waits_;
+        waiters_.emplace_back(ex, std::move(handler));
+        return;
+    }
+    lk.unlock();
+    boost::asio::post(ex, [handler = std::move(handler), buf = PooledBuffer(this, data)]() mutable {
+        handler(std::move(buf));
+    });
+}
+
+void BufferPool::release(char* data)
+{
+    std::unique_lock lk(mutex_);
+    if (!waiters_.empty()) {
+        // Hand it straight to the longest waiter; it stays in use
+        auto [ex, handler] = std::move(waiters_.front());
+        waiters_.pop_front();
+        ++acquires_;
+        lk.unlock();
+        boost::asio::post(ex, [handler = std::move(handler), buf = PooledBuffer(this, data)]() mutable {
+            handler(std::move(buf));
+        });
+        return;
+    }
+
+    --in_use_;
+    if (allocated_ > max_buffers()) {
+        // The pool was shrunk
+        --allocated_;
+        ::operator delete(data, std::align_val_t(ALIGNMENT));
+        return;
+    }
+    free_.push_back(data);
+}
+
+void BufferPool::set_capacity(size_t bytes)
+{
+    std::lock_guard lk(mutex_);
+    capacity_ = bytes;
+    while (allocated_ > max_buffers() && !free_.empty()) {
+        ::operator delete(free_.back(), std::align_val_t(ALIGNMENT));
+        free_.pop_back();
+        --allocated_;
+    }
+}
+
+BufferPool::Stats BufferPool::stats() const
+{
+    std::lock_guard lk(mutex_);
+    Stats s;
+    s.capacity = max_buffers() * CHUNK_SIZE;
+    s.allocated = allocated_ * CHUNK_SIZE;
+    s.in_use = in_use_ * CHUNK_SIZE;
+    s.peak_in_use = peak_in_use_ * CHUNK_SIZE;
+    s.waiting = waiters_.size();
+    s.acquires = acquires_;
+    s.allocations = allocations_;
+    s.waits = waits_;
+    return s;
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include "common.h"
+#include <cstdint>
+#include <deque>
+#include <functional>
+
+class BufferPool;
+
+// One CHUNK_SIZE transfer buffer; goes back to its pool when destroyed
+class PooledBuffer
+{
+public:
+    PooledBuffer() = default;
+    ~PooledBuffer();
+    PooledBuffer(PooledBuffer&& other) noexcept;
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    char* data() const { return data_; }
+    static constexpr size_t size() { return CHUNK_SIZE; }
+    explicit operator bool() const { return data_ != nullptr; }
+
+private:
+    friend class BufferPool;
+    PooledBuffer(BufferPool* pool, char* data) : pool_(pool), data_(data) {}
+
+    BufferPool* pool_ = nullptr;
+    char* data_ = nullptr;
+};
+
+// Chunk buffers shared by the server and the leecher.
+//
+// Buffers are page-aligned, never zero-filled, and kept on a free list when
+// released instead of going back to the allocator, so a transfer in steady
+// state doesn't allocate at all. At most `capacity` bytes of buffers exist
+// at once. When they are all in use, try_acquire() fails and async_acquire()
+// queues the caller until one is released; connections then wait, and TCP
+// flow control pushes back on the peer, instead of memory growing.
+class BufferPool
+{
+public:
+    using Handler = std::function<void(PooledBuffer)>;
+
+    static constexpr size_t ALIGNMENT = 4096;
+
+    explicit BufferPool(size_t capacity_bytes);
+
+    // A free buffer, or an empty one if the pool is exhausted
+    PooledBuffer try_acquire();
+
+    // Calls `handler` through `ex` once a buffer is available
+    void async_acquire(const boost::asio::any_io_executor& ex, Handler handler);
+
+    void set_capacity(size_t bytes);
+
+    struct Stats
+    {
+        size_t capacity = 0;      // bytes
+        size_t allocated = 0;     // bytes of buffers that exist
+        size_t in_use = 0;        // bytes handed out
+        size_t peak_in_use = 0;
+        size_t waiting = 0;       // callers queued for a buffer
+        uint64_t acquires = 0;
+        uint64_t allocations = 0; // acquires that had to allocate
+        uint64_t waits = 0;       // acquires that had to queue
+    };
+    Stats stats() const;
+
+private:
+    friend class PooledBuffer;
+    char* take_locked();
+    void release(char* data);
+    size_t max_buffers() const { return std::max<size_t>(1, capacity_ / CHUNK_SIZE); }
+
+    mutable std::mutex mutex_;
+    std::vector<char*> free_;
+    std::deque<std::pair<boost::asio::any_io_executor, Handler>> waiters_;
+    size_t capacity_;
+    size_t allocated_ = 0;  // buffers
+    size_t in_use_ = 0;
+    size_t peak_in_use_ = 0;
+    uint64_t acquires_ = 0;
+    uint64_t allocations_ = 0;
+    uint64_t waits_ = 0;
+};
+
+// Never destroyed: buffers may be released by detached threads at exit
+extern BufferPool& buffer_pool;
@@ -0,0 +1,103 @@
+#include "chunk_cache.h"
+
+namespace {
+
+std::string chunk_key(const CachedFile& file, size_t idx)
+{
+    return file.path + '\n' + std::to_string(file.size) + '\n' +
+        std::to_string(file.mtime.time_since_epoch().count()) + '\n' + std::to_string(idx);
+}
+
+} // namespace
+
+ChunkCache::ChunkCache(size_t capacity_bytes) : capacity_(capacity_bytes)
+{
+}
+
+void ChunkCache::get(std::shared_ptr<const CachedFile> file, size_t idx, uint64_t offset, size_t len,
+    boost::asio::any_io_executor ex, ChunkHandler handler)
+{
+    if (capacity_ == 0) return handler(nullptr);
+
+    std::string key = chunk_key(*file, idx);
+    {
+        std::unique_lock lk(mutex_);
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+            ++hits_;
+            ChunkData data = it->second.data;
+            lk.unlock();
+            return handler(std::move(data));
+        }
+
+        ++misses_;
+        auto loading = loading_.find(key);
+        if (loading != loading_.end()) {
+            // Someone is already reading this chunk; wait for their copy
+            loading->second.push_back(Waiter{ std::move(ex), std::move(handler) });
+            ++coalesced_;
+            return;
+        }
+
+        if (!ghosts_.count(key)) {
+            // First touch: remember it and let the caller send from the file
+            ghosts_.insert(key);
+            ghost_order_.push_back(key);
+            size_t max_ghosts = std::max<size_t>(64, 2 * capacity_ / CHUNK_SIZE);
+            while (ghost_order_.size() > max_ghosts) {
+                ghosts_.erase(ghost_order_.front());
+                ghost_order_.pop_front();
+            }
+            lk.unlock();
+            return handler(nullptr);
+        }
+
+        loading_[key].push_back(Waiter{ std::move(ex), std::move(handler) });
+    }
+
+    // Second touch: one disk read everyone shares, off the io threads
+    boost::asio::post(loaders_, [this, key, file = std::move(file), offset, len]() {
+        load(key, file, offset, len);
+    });
+}
+
+void ChunkCache::load(const std::string& key, std::shared_ptr<const CachedFile> file, uint64_t offset, size_t len)
+{
+    auto buf = std::make_shared<std::vector<char>>(len);
+    int64_t got = file->file.read_at(buf->data(), len, offset);
+    ChunkData data = got == static_cast<int64_t>(len) ? std::move(buf) : nullptr;
+
+    std::vector<Waiter> waiters;
+    {
+        std::lock_guard lk(mutex_);
+        waiters = std::move(loading_[key]);
+        loading_.erase(key);
+        if (data && len <= capacity_) {
+            lru_.push_front(key);
+            entries_[key] = Entry{ data, lru_.begin() };
+            bytes_ += len;
+            evict_locked();
+        }
+    }
+    for (auto& w : waiters) {
+        boost::asio::post(w.ex, [handler = std::move(w.handler), data]() { handler(data); });
+    }
+}
+
+void ChunkCache::set_capacity(size_t bytes)
+{
+    std::lock_guard lk(mutex_);
+    capacity_ = bytes;
+    evict_locked();
+}
+
+void ChunkCache::evict_locked()
+{
+    while (bytes_ > capacity_ && !lru_.empty()) {
+        auto it = entries_.find(lru_.back());
+        bytes_ -= it->second.data->size();
+        entries_.erase(it);
+        lru_.pop_back();
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "common.h"
+#include "file_cache.h"
+#include <functional>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+using ChunkData = std::shared_ptr<const std::vector<char>>;
+using ChunkHandler = std::function<void(ChunkData)>;
+
+// RAM cache of recently served chunks for flash crowds on a seeder.
+//
+// Admission is on second touch: the first request for a chunk is only
+// remembered (and served zero-copy from the page cache), a repeat request
+// while it is still remembered loads it into memory. Loads run on the
+// cache's own threads, never on a server io thread; concurrent misses for
+// the same chunk queue behind the one disk read. Keys include the file's size and
+// mtime, so a changed file never serves stale chunks. Eviction is LRU by
+// bytes.
+class ChunkCache
+{
+public:
+    explicit ChunkCache(size_t capacity_bytes = 64 * 1024 * 1024);
+
+    // Calls `handler` with the cached bytes for [offset, offset + len) of
+    // `file`, or with nullptr when the caller should send straight from the
+    // file. Hits and first touches complete inline; callers that wait on a
+    // load are completed through `ex`.
+    void get(std::shared_ptr<const CachedFile> file, size_t idx, uint64_t offset, size_t len,
+        boost::asio::any_io_executor ex, ChunkHandler handler);
+
+    void set_capacity(size_t bytes);
+    size_t capacity() const { return capacity_; }
+    size_t size_bytes() const { return bytes_; }
+
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+    uint64_t coalesced() const { return coalesced_; }  // misses that waited on another load
+
+private:
+    struct Entry
+    {
+        ChunkData data;
+        std::list<std::string>::iterator lru_pos;
+    };
+
+    struct Waiter
+    {
+        boost::asio::any_io_executor ex;
+        ChunkHandler handler;
+    };
+
+    void load(const std::string& key, std::shared_ptr<const CachedFile> file, uint64_t offset, size_t len);
+    void evict_locked();
+
+    std::mutex mutex_;
+    std::list<std::string> lru_;  // most recently used first
+    std::unordered_map<std::string, Entry> entries_;
+    std::unordered_map<std::string, std::vector<Waiter>> loading_;  // callers waiting per key
+
+    // Keys seen once but not admitted yet, oldest first
+    std::list<std::string> ghost_order_;
+    std::unordered_set<std::string> ghosts_;
+
+    std::atomic<size_t> capacity_;
+    std::atomic<size_t> bytes_{ 0 };
+    std::atomic<uint64_t> hits_{ 0 };
+    std::atomic<uint64_t> misses_{ 0 };
+    std::atomic<uint64_t> coalesced_{ 0 };
+
+    boost::asio::thread_pool loaders_{ 2 };
+};
@@ -15,6 +15,9 @@ namespace fs = std::filesystem;
 using boost::asio::ip::tcp;
 constexpr size_t CHUNK_SIZE = 1024 * 256; // 256KB
 
+// Longest any outbound connection attempt may take
+constexpr auto CONNECT_TIMEOUT = std::chrono::seconds(3);
+
 extern std::mutex cout_mutex;
 extern std::string tracker_ip;
 extern unsigned short tracker_port;
@@ -22,12 +25,25 @@ extern std::string local_ip;
 extern unsigned short p2p_port;
 
 // Progress tracking
+struct PeerProgress
+{
+    std::string peer;
+    double rate = 0.0;     // bytes/sec, EWMA
+    double latency = 0.0;  // seconds from request to first byte, EWMA
+    size_t chunks = 0;
+    size_t connections = 0;  // open to this peer now
+    std::string health = "100%";  // success score, or the state of its circuit breaker
+    bool active = true;
+};
+
 struct DownloadProgress 
 {
     std::string filename;
     size_t total_chunks;
     size_t completed_chunks;
     bool finished;
+    bool interrupted = false;  // stopped before completing; resumable
+    std::vector<PeerProgress> peers;
     std::mutex mutex;
 };
 
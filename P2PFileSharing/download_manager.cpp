@@ -0,0 +1,197 @@
+#include "download_manager.h"
+#include "download_state.h"
+#include "leecher.h"
+#include "logger.h"
+
+DownloadManager download_manager;
+
+const char* priority_name(Priority p)
+{
+    switch (p) {
+    case Priority::Low: return "low";
+    case Priority::High: return "high";
+    default: return "normal";
+    }
+}
+
+bool parse_priority(const std::string& name, Priority& out)
+{
+    if (name == "low") out = Priority::Low;
+    else if (name == "normal" || name.empty()) out = Priority::Normal;
+    else if (name == "high") out = Priority::High;
+    else return false;
+    return true;
+}
+
+bool DownloadManager::add(const std::vector<std::string>& peers, const std::string& request_fn,
+    const std::string& save_fn, unsigned short my_port, const std::string& tracker_ip,
+    unsigned short tracker_port, Priority priority)
+{
+    std::vector<Entry> start;
+    {
+        std::lock_guard lk(mutex_);
+        if (entries_.count(save_fn)) return false;
+        entries_[save_fn] = Entry{ request_fn, save_fn, peers, priority, State::Queued, next_seq_++,
+            my_port, tracker_ip, tracker_port };
+        start = admit_locked();
+    }
+    log_line(LogLevel::Info, "[Downloads] Queued ", save_fn, " (", priority_name(priority), " priority)");
+    launch(start);
+    return true;
+}
+
+bool DownloadManager::add_saved(const std::string& save_fn, unsigned short my_port,
+    const std::string& tracker_ip, unsigned short tracker_port, Priority priority)
+{
+    SavedDownload saved;
+    if (!load_download_state(save_fn, saved)) return false;
+    return add({}, saved.request_fn, save_fn, my_port, tracker_ip, tracker_port, priority);
+}
+
+bool DownloadManager::pause(const std::string& save_fn)
+{
+    std::lock_guard lk(mutex_);
+    auto it = entries_.find(save_fn);
+    if (it == entries_.end()) return false;
+    State& state = it->second.state;
+    if (state == State::Queued) state = State::Paused;
+    else if (state == State::Active) state = State::Pausing;
+    else return false;
+    log_line(LogLevel::Info, "[Downloads] Pausing ", save_fn);
+    return true;
+}
+
+bool DownloadManager::resume(const std::string& save_fn)
+{
+    std::vector<Entry> start;
+    {
+        std::lock_guard lk(mutex_);
+        auto it = entries_.find(save_fn);
+        if (it == entries_.end()) return false;
+        State& state = it->second.state;
+        if (state == State::Pausing) state = State::Active;  // hasn't stopped yet
+        else if (state == State::Paused) state = State::Queued;
+        else return false;
+        start = admit_locked();
+    }
+    launch(start);
+    return true;
+}
+
+bool DownloadManager::set_priority(const std::string& save_fn, Priority priority)
+{
+    std::lock_guard lk(mutex_);
+    auto it = entries_.find(save_fn);
+    if (it == entries_.end()) return false;
+    it->second.priority = priority;
+    return true;
+}
+
+void DownloadManager::set_max_active(size_t n)
+{
+    std::vector<Entry> start;
+    {
+        std::lock_guard lk(mutex_);
+        max_active_ = std::max<size_t>(n, 1);
+        start = admit_locked();
+    }
+    launch(start);
+}
+
+size_t DownloadManager::max_active() const
+{
+    std::lock_guard lk(mutex_);
+    return max_active_;
+}
+
+std::vector<DownloadManager::Entry> DownloadManager::entries() const
+{
+    std::vector<Entry> out;
+    {
+        std::lock_guard lk(mutex_);
+        for (const auto& [name, e] : entries_) out.push_back(e);
+    }
+    auto running = [](const Entry& e) { return e.state == State::Active || e.state == State::Pausing; };
+    std::sort(out.begin(), out.end(), [&](const Entry& a, const Entry& b) {
+        if (running(a) != running(b)) return running(a);
+        if (a.priority != b.priority) return a.priority > b.priority;
+        return a.seq < b.seq;
+    });
+    return out;
+}
+
+bool DownloadManager::poll(const std::string& save_fn, unsigned& weight)
+{
+    std::lock_guard lk(mutex_);
+    auto it = entries_.find(save_fn);
+    if (it == entries_.end()) return true;
+    weight = static_cast<unsigned>(it->second.priority);
+    it->second.stopping = it->second.state != State::Active;
+    return !it->second.stopping;
+}
+
+void DownloadManager::stopped(const std::string& save_fn, bool complete)
+{
+    std::vector<Entry> start;
+    {
+        std::lock_guard lk(mutex_);
+        auto it = entries_.find(save_fn);
+        if (it == entries_.end()) return;
+        Entry& e = it->second;
+        bool resumed = e.state == State::Active && e.stopping;  // while it was already stopping
+        if (!complete && (e.state == State::Pausing || resumed)) {
+            e.state = resumed ? State::Queued : State::Paused;
+            e.stopping = false;
+            // Once there is resume state, resuming picks up from it
+            if (std::filesystem::exists(state_path(save_fn))) e.peers.clear();
+            log_line(LogLevel::Info, "[Downloads] ", resumed ? "Requeued " : "Paused ", save_fn);
+        }
+        else {
+            // Finished, or failed: an interrupted download is resumed
+            // from the progress page, which queues it again
+            entries_.erase(it);
+        }
+        start = admit_locked();
+    }
+    launch(start);
+}
+
+std::vector<DownloadManager::Entry> DownloadManager::admit_locked()
+{
+    size_t active = 0;
+    for (const auto& [name, e] : entries_) {
+        if (e.state == State::Active || e.state == State::Pausing) ++active;
+    }
+
+    std::vector<Entry> start;
+    while (active < max_active_) {
+        Entry* next = nullptr;
+        for (auto& [name, e] : entries_) {
+            if (e.state != State::Queued) continue;
+            if (!next || e.priority > next->priority || (e.priority == next->priority && e.seq < next->seq))
+                next = &e;
+        }
+        if (!next) break;
+        next->state = State::Active;
+        start.push_back(*next);
+        ++active;
+    }
+    return start;
+}
+
+void DownloadManager::launch(const std::vector<Entry>& entries)
+{
+    for (const auto& e : entries) {
+        log_line(LogLevel::Info, "[Downloads] Starting ", e.save_fn);
+        if (!e.peers.empty()) {
+            start_download(e.peers, e.request_fn, e.save_fn, e.my_port, e.tracker_ip, e.tracker_port);
+            continue;
+        }
+
+        // Resuming asks the tracker for peers first, which may take seconds;
+        // this can be running on a download's strand
+        std::thread([this, e]() {
+            if (!resume_download(e.save_fn, e.my_port, e.tracker_ip, e.tracker_port)) stopped(e.save_fn, false);
+            }).detach();
+    }
+}
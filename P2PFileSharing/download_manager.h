@@ -0,0 +1,80 @@
+#pragma once
+#include "common.h"
+#include <cstdint>
+#include <unordered_map>
+
+// A download's share of the bandwidth and connection budget relative to the
+// others running; the value is its weight
+enum class Priority : unsigned { Low = 1, Normal = 2, High = 4 };
+
+const char* priority_name(Priority p);
+bool parse_priority(const std::string& name, Priority& out);
+
+// Queue in front of the leecher. Downloads wait here until one of the
+// max_active slots is free, highest priority first and oldest first within
+// a priority. Running downloads split the global download limit and the
+// connection budget in proportion to their priority.
+//
+// Pausing stops a download's connections but keeps its resume state, so
+// resuming it queues it again and only fetches the chunks still missing.
+// A running download polls the manager once a tune interval, which is how
+// pauses and priority changes reach it.
+class DownloadManager
+{
+public:
+    enum class State { Queued, Active, Pausing, Paused };
+
+    struct Entry
+    {
+        std::string request_fn;
+        std::string save_fn;
+        std::vector<std::string> peers;  // empty: restart from the state file
+        Priority priority = Priority::Normal;
+        State state = State::Queued;
+        uint64_t seq = 0;                // queue order
+        unsigned short my_port = 0;
+        std::string tracker_ip;
+        unsigned short tracker_port = 0;
+        bool stopping = false;           // the running download was last told to stop
+    };
+
+    // Queues a new download; false if one is already queued under `save_fn`
+    bool add(const std::vector<std::string>& peers, const std::string& request_fn,
+        const std::string& save_fn, unsigned short my_port, const std::string& tracker_ip,
+        unsigned short tracker_port, Priority priority = Priority::Normal);
+
+    // Queues an interrupted download from downloads/<save_fn>.p2pstate
+    bool add_saved(const std::string& save_fn, unsigned short my_port,
+        const std::string& tracker_ip, unsigned short tracker_port, Priority priority = Priority::Normal);
+
+    bool pause(const std::string& save_fn);
+    bool resume(const std::string& save_fn);
+    bool set_priority(const std::string& save_fn, Priority priority);
+
+    void set_max_active(size_t n);
+    size_t max_active() const;
+
+    // Queue order: running downloads first, then by priority and age
+    std::vector<Entry> entries() const;
+
+    // For the leecher: false once the download should stop; `weight` is
+    // its current priority
+    bool poll(const std::string& save_fn, unsigned& weight);
+
+    // For the leecher: a download it started has stopped, complete or not
+    void stopped(const std::string& save_fn, bool complete);
+
+private:
+    // Marks queued downloads active while slots are free; the caller
+    // starts them once the lock is released, and launch() does any tracker
+    // lookup on a thread of its own
+    std::vector<Entry> admit_locked();
+    void launch(const std::vector<Entry>& entries);
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;  // by save_fn
+    size_t max_active_ = 3;
+    uint64_t next_seq_ = 0;
+};
+
+extern DownloadManager download_manager;
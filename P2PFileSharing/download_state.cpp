@@ -0,0 +1,138 @@
+#include "download_state.h"
+#include "logger.h"
+#include <sstream>
+
+namespace {
+
+constexpr const char* STATE_EXTENSION = ".p2pstate";
+constexpr const char* STATE_MAGIC = "P2PSTATE 1";
+
+} // namespace
+
+size_t SavedDownload::chunks_done() const
+{
+    return std::count(have.begin(), have.end(), true);
+}
+
+bool DownloadState::create(const SavedDownload& d)
+{
+    path_ = state_path(d.save_fn);
+
+    std::ostringstream header;
+    header << STATE_MAGIC << "\n";
+    header << "request " << d.request_fn << "\n";
+    header << "size " << d.filesize << "\n";
+    header << "chunk " << CHUNK_SIZE << "\n";
+    header << "peers";
+    for (const auto& peer : d.peers) header << " " << peer;
+    header << "\n";
+    header << "bitmap\n";
+
+    size_t chunks = (d.filesize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    bits_.assign((chunks + 7) / 8, 0);
+    for (size_t i = 0; i < d.have.size() && i < chunks; ++i) {
+        if (d.have[i]) bits_[i / 8] |= 0x80 >> (i % 8);
+    }
+
+    std::string h = header.str();
+    bitmap_at_ = h.size();
+    dirty_begin_ = SIZE_MAX;
+    dirty_end_ = 0;
+    if (!file_.open(path_, h.size() + bits_.size(), false) ||
+        !file_.write_at(h.data(), h.size(), 0) ||
+        !file_.write_at(reinterpret_cast<const char*>(bits_.data()), bits_.size(), bitmap_at_)) {
+        log_line(LogLevel::Warn, "[Leecher] Could not create ", path_, "; this download won't be resumable");
+        file_ = OutputFile();
+        return false;
+    }
+    return true;
+}
+
+void DownloadState::mark(size_t idx)
+{
+    if (idx / 8 >= bits_.size()) return;
+    bits_[idx / 8] |= 0x80 >> (idx % 8);
+    dirty_begin_ = std::min(dirty_begin_, idx / 8);
+    dirty_end_ = std::max(dirty_end_, idx / 8 + 1);
+}
+
+void DownloadState::flush(bool durable)
+{
+    if (!file_.valid() || dirty_begin_ >= dirty_end_) return;
+    file_.write_at(reinterpret_cast<const char*>(bits_.data()) + dirty_begin_,
+        dirty_end_ - dirty_begin_, bitmap_at_ + dirty_begin_);
+    if (durable) file_.sync();
+    dirty_begin_ = SIZE_MAX;
+    dirty_end_ = 0;
+}
+
+void DownloadState::remove()
+{
+    file_ = OutputFile();
+    if (path_.empty()) return;
+    std::error_code ec;
+    std::filesystem::remove(path_, ec);
+}
+
+std::string state_path(const std::string& save_fn)
+{
+    return (std::filesystem::path("downloads") / (save_fn + STATE_EXTENSION)).string();
+}
+
+bool is_state_file(const std::filesystem::path& path)
+{
+    return path.extension() == STATE_EXTENSION;
+}
+
+bool load_download_state(const std::string& save_fn, SavedDownload& out)
+{
+    std::ifstream in(state_path(save_fn), std::ios::binary);
+    std::string line;
+    if (!std::getline(in, line) || line != STATE_MAGIC) return false;
+
+    SavedDownload d;
+    d.save_fn = save_fn;
+    size_t chunk_size = 0;
+    while (std::getline(in, line) && line != "bitmap") {
+        std::istringstream fields(line);
+        std::string key;
+        fields >> key;
+        if (key == "request") fields >> d.request_fn;
+        else if (key == "size") fields >> d.filesize;
+        else if (key == "chunk") fields >> chunk_size;
+        else if (key == "peers") {
+            std::string peer;
+            while (fields >> peer) d.peers.push_back(peer);
+        }
+    }
+    // A different chunk size would map the bitmap onto the wrong bytes
+    if (line != "bitmap" || d.request_fn.empty() || d.filesize == 0 || chunk_size != CHUNK_SIZE) return false;
+
+    size_t chunks = (d.filesize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    std::vector<char> bits((chunks + 7) / 8);
+    if (!in.read(bits.data(), bits.size())) return false;
+    d.have.resize(chunks);
+    for (size_t i = 0; i < chunks; ++i) {
+        d.have[i] = (static_cast<uint8_t>(bits[i / 8]) & (0x80 >> (i % 8))) != 0;
+    }
+
+    // The chunks it lists must still be there
+    std::error_code ec;
+    if (!std::filesystem::exists(std::filesystem::path("downloads") / save_fn, ec)) return false;
+
+    out = std::move(d);
+    return true;
+}
+
+std::vector<SavedDownload> saved_downloads()
+{
+    std::vector<SavedDownload> found;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator("downloads", ec)) {
+        if (!entry.is_regular_file() || !is_state_file(entry.path())) continue;
+        SavedDownload d;
+        if (load_download_state(entry.path().stem().string(), d)) found.push_back(std::move(d));
+        else log_line(LogLevel::Warn, "[Leecher] Ignoring unreadable download state ", entry.path().string());
+    }
+    return found;
+}
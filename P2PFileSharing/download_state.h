@@ -0,0 +1,56 @@
+#pragma once
+#include "common.h"
+#include "file_transfer.h"
+#include <cstdint>
+
+// What a download needs to pick up where it left off after a restart
+struct SavedDownload
+{
+    std::string request_fn;          // name the file has on the network
+    std::string save_fn;             // name under downloads/
+    uint64_t filesize = 0;
+    std::vector<std::string> peers;  // peers it was downloading from
+    std::vector<bool> have;          // chunks already on disk
+
+    size_t chunks_done() const;
+};
+
+// Sidecar state of an unfinished download, kept as downloads/<name>.p2pstate
+// until the file is complete. A short text header (source name, size, chunk
+// size, peers) is followed by the completed-chunk bitmap, chunk 0 in the high
+// bit of the first byte. Chunks are marked in memory and written out by
+// flush(), which rewrites only the bytes of the bitmap that changed. The
+// leecher flushes only after the chunks' data is on disk, so the bitmap
+// never claims a chunk that isn't in the file.
+class DownloadState
+{
+public:
+    // Starts a fresh state file for `d`, replacing any old one
+    bool create(const SavedDownload& d);
+
+    void mark(size_t idx);
+
+    // Writes the chunks marked since the last flush; `durable` also syncs
+    // the state file
+    void flush(bool durable);
+
+    // The download finished: the state file is no longer needed
+    void remove();
+
+private:
+    std::string path_;
+    OutputFile file_;
+    uint64_t bitmap_at_ = 0;
+    std::vector<uint8_t> bits_;
+    size_t dirty_begin_ = SIZE_MAX;  // bytes of bits_ not written out yet
+    size_t dirty_end_ = 0;
+};
+
+std::string state_path(const std::string& save_fn);
+bool is_state_file(const std::filesystem::path& path);
+
+// Reads downloads/<save_fn>.p2pstate; false if missing or unreadable
+bool load_download_state(const std::string& save_fn, SavedDownload& out);
+
+// Every unfinished download found under downloads/
+std::vector<SavedDownload> saved_downloads();
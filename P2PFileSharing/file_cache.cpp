@@ -0,0 +1,90 @@
+#include "file_cache.h"
+
+FileCache::FileCache(size_t capacity, std::chrono::milliseconds revalidate_after)
+    : capacity_(std::max<size_t>(capacity, 1)), revalidate_after_(revalidate_after)
+{
+}
+
+std::string FileCache::resolve(const std::string& fn)
+{
+    // 1) Always serve the real file in shared_files/
+    std::filesystem::path shared = std::filesystem::path("shared_files") / fn;
+    if (std::filesystem::exists(shared)) return shared.string();
+
+    // 2) Maybe it's a downloaded file (for Leecher)
+    std::filesystem::path dl = std::filesystem::path("downloads") / fn;
+    if (std::filesystem::exists(dl)) return dl.string();
+
+    // 3) Check current folder (fallback)
+    if (std::filesystem::exists(fn)) return fn;
+
+    // 4) Otherwise, return where the Leecher would put it
+    return dl.string();
+}
+
+std::shared_ptr<const CachedFile> FileCache::get(const std::string& name)
+{
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard lk(mutex_);
+        auto it = entries_.find(name);
+        if (it != entries_.end() && now - it->second.checked < revalidate_after_) {
+            lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+            ++hits_;
+            return it->second.file;
+        }
+    }
+
+    // Revalidate outside the lock; file system calls can be slow
+    std::string path = resolve(name);
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(path, ec);
+    auto mtime = ec ? fs::file_time_type{} : std::filesystem::last_write_time(path, ec);
+
+    std::lock_guard lk(mutex_);
+    auto it = entries_.find(name);
+    if (ec) {
+        if (it != entries_.end()) {
+            lru_.erase(it->second.lru_pos);
+            entries_.erase(it);
+        }
+        return nullptr;
+    }
+
+    if (it != entries_.end()) {
+        const auto& cur = *it->second.file;
+        if (cur.path == path && cur.size == size && cur.mtime == mtime) {
+            it->second.checked = now;
+            lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+            ++hits_;
+            return it->second.file;
+        }
+        // Changed on disk: drop the entry, in-flight senders keep their copy
+        lru_.erase(it->second.lru_pos);
+        entries_.erase(it);
+    }
+
+    auto file = open(path, mtime);
+    if (!file) return nullptr;
+
+    if (entries_.size() >= capacity_) {
+        entries_.erase(lru_.back());
+        lru_.pop_back();
+    }
+    lru_.push_front(name);
+    entries_[name] = Entry{ file, now, lru_.begin() };
+    return file;
+}
+
+std::shared_ptr<const CachedFile> FileCache::open(const std::string& path,
+    fs::file_time_type mtime)
+{
+    auto cf = std::make_shared<CachedFile>();
+    cf->path = path;
+    cf->file = FileHandle(path);
+    if (!cf->file.valid()) return nullptr;
+    cf->size = cf->file.size();
+    cf->mtime = mtime;
+    ++opens_;
+    return cf;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "common.h"
+#include "file_transfer.h"
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+// An open served file plus the metadata it was opened with
+struct CachedFile
+{
+    std::string path;
+    FileHandle file;
+    uint64_t size = 0;
+    fs::file_time_type mtime;
+};
+
+// Bounded LRU of open descriptors keyed by requested file name, shared by
+// all server worker threads. Entries are revalidated against the file
+// system at most once per `revalidate_after`, so a hot file costs one
+// resolve + stat per interval instead of several per request. A file that
+// changed (size or mtime) is reopened; senders still holding the old entry
+// finish on the old descriptor.
+class FileCache
+{
+public:
+    explicit FileCache(size_t capacity = 64,
+        std::chrono::milliseconds revalidate_after = std::chrono::milliseconds(1000));
+
+    // Returns the open file for `name`, or nullptr if it does not exist
+    std::shared_ptr<const CachedFile> get(const std::string& name);
+
+    // Where a request for `name` is served from (shared_files/, downloads/, cwd)
+    static std::string resolve(const std::string& name);
+
+    uint64_t hits() const { return hits_; }
+    uint64_t opens() const { return opens_; }
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<const CachedFile> file;
+        std::chrono::steady_clock::time_point checked;
+        std::list<std::string>::iterator lru_pos;
+    };
+
+    std::shared_ptr<const CachedFile> open(const std::string& path, fs::file_time_type mtime);
+
+    std::mutex mutex_;
+    std::list<std::string> lru_;  // most recently used first
+    std::unordered_map<std::string, Entry> entries_;
+    size_t capacity_;
+    std::chrono::milliseconds revalidate_after_;
+    std::atomic<uint64_t> hits_{ 0 };
+    std::atomic<uint64_t> opens_{ 0 };
+};
@@ -0,0 +1,325 @@
+#include "file_transfer.h"
+#include "buffer_pool.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+bool zero_copy_enabled = true;
+
+FileHandle::FileHandle(const std::string& path)
+{
+#ifdef _WIN32
+    fd_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+#else
+    fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+}
+
+FileHandle::~FileHandle()
+{
+    close();
+}
+
+FileHandle::FileHandle(FileHandle&& other) noexcept : fd_(other.fd_)
+{
+    other.fd_ = FileHandle().fd_;
+}
+
+FileHandle& FileHandle::operator=(FileHandle&& other) noexcept
+{
+    if (this != &other) {
+        close();
+        fd_ = other.fd_;
+        other.fd_ = FileHandle().fd_;
+    }
+    return *this;
+}
+
+bool FileHandle::valid() const
+{
+#ifdef _WIN32
+    return fd_ != INVALID_HANDLE_VALUE;
+#else
+    return fd_ >= 0;
+#endif
+}
+
+uint64_t FileHandle::size() const
+{
+    if (!valid()) return 0;
+#ifdef _WIN32
+    LARGE_INTEGER sz;
+    return GetFileSizeEx(fd_, &sz) ? static_cast<uint64_t>(sz.QuadPart) : 0;
+#else
+    struct stat st;
+    return ::fstat(fd_, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+#endif
+}
+
+int64_t FileHandle::read_at(char* dst, size_t len, uint64_t offset) const
+{
+#ifdef _WIN32
+    OVERLAPPED ov{};
+    ov.Offset = static_cast<DWORD>(offset);
+    ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD got = 0;
+    if (!ReadFile(fd_, dst, static_cast<DWORD>(len), &got, &ov)) return -1;
+    return got;
+#else
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = ::pread(fd_, dst + done, len - done, static_cast<off_t>(offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += static_cast<size_t>(n);
+    }
+    return static_cast<int64_t>(done);
+#endif
+}
+
+void FileHandle::close()
+{
+    if (!valid()) return;
+#ifdef _WIN32
+    CloseHandle(fd_);
+    fd_ = INVALID_HANDLE_VALUE;
+#else
+    ::close(fd_);
+    fd_ = -1;
+#endif
+}
+
+OutputFile::~OutputFile()
+{
+    close();
+}
+
+OutputFile::OutputFile(OutputFile&& other) noexcept : fd_(other.fd_)
+{
+    other.fd_ = OutputFile().fd_;
+}
+
+OutputFile& OutputFile::operator=(OutputFile&& other) noexcept
+{
+    if (this != &other) {
+        close();
+        fd_ = other.fd_;
+        other.fd_ = OutputFile().fd_;
+    }
+    return *this;
+}
+
+bool OutputFile::open(const std::string& path, uint64_t size, bool keep)
+{
+    close();
+#ifdef _WIN32
+    fd_ = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, keep ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (!valid()) return false;
+    LARGE_INTEGER end;
+    end.QuadPart = static_cast<LONGLONG>(size);
+    if (!SetFilePointerEx(fd_, end, nullptr, FILE_BEGIN) || !SetEndOfFile(fd_)) {
+        close();
+        return false;
+    }
+#else
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (keep ? 0 : O_TRUNC), 0644);
+    if (!valid()) return false;
+#ifdef __linux__
+    // Real blocks rather than a sparse file; filesystems that can't do it
+    // fall back to the plain length below
+    if (size > 0 && ::fallocate(fd_, 0, 0, static_cast<off_t>(size)) != 0 && errno == ENOSPC) {
+        close();
+        return false;
+    }
+#endif
+    if (::ftruncate(fd_, static_cast<off_t>(size)) != 0) {
+        close();
+        return false;
+    }
+#endif
+    return true;
+}
+
+bool OutputFile::valid() const
+{
+#ifdef _WIN32
+    return fd_ != INVALID_HANDLE_VALUE;
+#else
+    return fd_ >= 0;
+#endif
+}
+
+bool OutputFile::write_at(const char* src, size_t len, uint64_t offset)
+{
+    if (!valid()) return false;
+#ifdef _WIN32
+    while (len > 0) {
+        OVERLAPPED ov{};
+        ov.Offset = static_cast<DWORD>(offset);
+        ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD wrote = 0;
+        if (!WriteFile(fd_, src, static_cast<DWORD>(len), &wrote, &ov) || wrote == 0) return false;
+        src += wrote;
+        offset += wrote;
+        len -= wrote;
+    }
+#else
+    while (len > 0) {
+        ssize_t n = ::pwrite(fd_, src, len, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        src += n;
+        offset += static_cast<uint64_t>(n);
+        len -= static_cast<size_t>(n);
+    }
+#endif
+    return true;
+}
+
+bool OutputFile::sync()
+{
+    if (!valid()) return false;
+#ifdef _WIN32
+    return FlushFileBuffers(fd_) != 0;
+#elif defined(__linux__)
+    return ::fdatasync(fd_) == 0;
+#else
+    return ::fsync(fd_) == 0;
+#endif
+}
+
+void OutputFile::close()
+{
+    if (!valid()) return;
+#ifdef _WIN32
+    CloseHandle(fd_);
+    fd_ = INVALID_HANDLE_VALUE;
+#else
+    ::close(fd_);
+    fd_ = -1;
+#endif
+}
+
+namespace {
+
+// Copies the range through one pooled buffer, a block at a time. The
+// buffer is taken when the first block is read and goes back to the pool
+// with the last reference to this object.
+struct BufferedSend : std::enable_shared_from_this<BufferedSend>
+{
+    tcp::socket& sock;
+    const FileHandle& file;
+    uint64_t offset;
+    size_t remaining;
+    size_t sent = 0;
+    SendHandler handler;
+    PooledBuffer buf;
+
+    BufferedSend(tcp::socket& s, const FileHandle& f, uint64_t off, size_t len, SendHandler h)
+        : sock(s), file(f), offset(off), remaining(len), handler(std::move(h))
+    {
+    }
+
+    void step()
+    {
+        if (remaining == 0) return handler({}, sent);
+
+        if (!buf) {
+            auto self = shared_from_this();
+            buffer_pool.async_acquire(sock.get_executor(), [self](PooledBuffer b) {
+                self->buf = std::move(b);
+                self->step();
+            });
+            return;
+        }
+
+        size_t want = std::min(remaining, buf.size());
+        int64_t n = file.read_at(buf.data(), want, offset);
+        if (n <= 0) return handler(boost::asio::error::make_error_code(boost::asio::error::eof), sent);
+
+        auto self = shared_from_this();
+        boost::asio::async_write(sock, boost::asio::buffer(buf.data(), static_cast<size_t>(n)),
+            [self](const boost::system::error_code& ec, size_t written) {
+                self->sent += written;
+                if (ec) return self->handler(ec, self->sent);
+                self->offset += written;
+                self->remaining -= written;
+                self->step();
+            });
+    }
+};
+
+#ifdef __linux__
+// Pushes the range with sendfile(), parking on async_wait whenever the
+// socket buffer is full so no worker thread ever blocks on a slow peer
+struct SendfileSend : std::enable_shared_from_this<SendfileSend>
+{
+    tcp::socket& sock;
+    const FileHandle& file;
+    off_t offset;
+    size_t remaining;
+    size_t sent = 0;
+    SendHandler handler;
+
+    SendfileSend(tcp::socket& s, const FileHandle& f, uint64_t off, size_t len, SendHandler h)
+        : sock(s), file(f), offset(static_cast<off_t>(off)), remaining(len), handler(std::move(h))
+    {
+    }
+
+    void step()
+    {
+        while (remaining > 0) {
+            ssize_t n = ::sendfile(sock.native_handle(), file.get(), &offset, remaining);
+            if (n > 0) {
+                sent += static_cast<size_t>(n);
+                remaining -= static_cast<size_t>(n);
+                continue;
+            }
+            if (n == 0) {
+                // The file shrank under us
+                return handler(boost::asio::error::make_error_code(boost::asio::error::eof), sent);
+            }
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                auto self = shared_from_this();
+                sock.async_wait(tcp::socket::wait_write, [self](const boost::system::error_code& ec) {
+                    if (ec) return self->handler(ec, self->sent);
+                    self->step();
+                    });
+                return;
+            }
+            return handler(boost::system::error_code(errno, boost::system::system_category()), sent);
+        }
+        handler({}, sent);
+    }
+};
+#endif
+
+} // namespace
+
+void async_send_file_range(tcp::socket& sock, const FileHandle& file,
+    uint64_t offset, size_t len, SendHandler handler)
+{
+#ifdef __linux__
+    if (zero_copy_enabled) {
+        boost::system::error_code ec;
+        sock.native_non_blocking(true, ec);
+        if (!ec) {
+            std::make_shared<SendfileSend>(sock, file, offset, len, std::move(handler))->step();
+            return;
+        }
+    }
+#endif
+    std::make_shared<BufferedSend>(sock, file, offset, len, std::move(handler))->step();
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include "common.h"
+#include <cstdint>
+#include <functional>
+
+#ifdef _WIN32
+using native_file = HANDLE;
+#else
+using native_file = int;
+#endif
+
+// Move-only owner of a raw read-only file descriptor (HANDLE on Windows)
+class FileHandle
+{
+public:
+    FileHandle() = default;
+    explicit FileHandle(const std::string& path);
+    ~FileHandle();
+    FileHandle(FileHandle&& other) noexcept;
+    FileHandle& operator=(FileHandle&& other) noexcept;
+    FileHandle(const FileHandle&) = delete;
+    FileHandle& operator=(const FileHandle&) = delete;
+
+    bool valid() const;
+    native_file get() const { return fd_; }
+    uint64_t size() const;
+
+    // Positional read; returns bytes read or -1 on error
+    int64_t read_at(char* dst, size_t len, uint64_t offset) const;
+
+private:
+    void close();
+
+#ifdef _WIN32
+    native_file fd_ = INVALID_HANDLE_VALUE;
+#else
+    native_file fd_ = -1;
+#endif
+};
+
+// Move-only owner of a writable file descriptor for a download's
+// destination. Writes are positional, so threads writing different ranges
+// share neither a file offset nor a lock.
+class OutputFile
+{
+public:
+    OutputFile() = default;
+    ~OutputFile();
+    OutputFile(OutputFile&& other) noexcept;
+    OutputFile& operator=(OutputFile&& other) noexcept;
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    // Opens `path`, creating it if needed, and reserves all `size` bytes up
+    // front (fallocate on Linux, otherwise by setting the length) so a full
+    // disk shows up now rather than halfway through. Existing contents are
+    // kept only when `keep` is set.
+    bool open(const std::string& path, uint64_t size, bool keep);
+
+    bool valid() const;
+
+    // Positional write of all `len` bytes; false on error
+    bool write_at(const char* src, size_t len, uint64_t offset);
+
+    // Forces the data written so far to disk
+    bool sync();
+
+private:
+    void close();
+
+#ifdef _WIN32
+    native_file fd_ = INVALID_HANDLE_VALUE;
+#else
+    native_file fd_ = -1;
+#endif
+};
+
+// When false, file ranges are always copied through a userspace buffer
+extern bool zero_copy_enabled;
+
+using SendHandler = std::function<void(const boost::system::error_code&, size_t)>;
+
+// Sends [offset, offset + len) of `file` to `sock`. On Linux the bytes go
+// from the page cache straight to the socket with sendfile(); elsewhere (or
+// with zero_copy_enabled off) they are read into a buffer and written.
+// `file` must stay open until the handler runs.
+void async_send_file_range(tcp::socket& sock, const FileHandle& file,
+    uint64_t offset, size_t len, SendHandler handler);
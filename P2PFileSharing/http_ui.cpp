@@ -1,4 +1,9 @@
 #include "http_ui.h"
+#include "server.h"
+#include "download_manager.h"
+#include "download_state.h"
+#include "manifest.h"
+#include "buffer_pool.h"
 #include <iomanip>
 #include <ctime>
 
@@ -48,7 +53,10 @@ std::string get_common_css() {
     css << ".form-row { display: flex; gap: 10px; margin-bottom: 10px; flex-wrap: wrap; }";
     css << "input[type='text'] { flex: 1; padding: 12px; border: 1px solid #ddd; border-radius: 4px; font-size: 14px; min-width: 200px; }";
     css << "button { background: #3498db; color: white; border: none; padding: 12px 20px; border-radius: 4px; cursor: pointer; font-weight: bold; transition: background 0.2s; }";
+    css << "select { padding: 12px; border: 1px solid #ddd; border-radius: 4px; font-size: 14px; background: white; }";
     css << "button:hover { background: #2980b9; }";
+    css << ".inline-form { margin: 0; flex-direction: row; gap: 6px; }";
+    css << ".inline-form button, .inline-form select { padding: 6px 10px; }";
     css << ".file-list { list-style-type: none; padding: 0; }";
     css << ".file-item { display: flex; justify-content: space-between; padding: 12px; background: white; margin-bottom: 8px; border-radius: 4px; box-shadow: 0 1px 3px rgba(0,0,0,0.05); }";
     css << ".file-name { font-weight: bold; color: #2c3e50; }";
@@ -58,6 +66,11 @@ std::string get_common_css() {
     css << ".badge { display: inline-block; padding: 5px 10px; border-radius: 20px; font-size: 12px; font-weight: bold; text-transform: uppercase; }";
     css << ".badge-success { background-color: #2ecc71; color: white; }";
     css << ".badge-progress { background-color: #f39c12; color: white; }";
+    css << ".badge-interrupted { background-color: #e74c3c; color: white; }";
+    css << ".badge-paused { background-color: #95a5a6; color: white; }";
+    css << ".peer-table { width: 100%; border-collapse: collapse; margin-top: 10px; font-size: 0.9em; }";
+    css << ".peer-table th, .peer-table td { text-align: left; padding: 6px 10px; border-bottom: 1px solid #eee; }";
+    css << ".peer-done { color: #95a5a6; }";
     css << ".button-row { display: flex; gap: 10px; margin-top: 20px; }";
     css << ".nav-link { display: inline-block; background: #3498db; color: white; padding: 10px 15px; text-decoration: none; border-radius: 5px; margin-right: 10px; }";
     css << ".nav-link:hover { background: #2980b9; }";
@@ -91,6 +104,27 @@ std::string get_page_footer() {
     return footer.str();
 }
 
+// Priority picker for the download forms
+std::string priority_select(Priority selected) {
+    std::stringstream select;
+    select << "<select name='priority'>";
+    for (Priority p : { Priority::Low, Priority::Normal, Priority::High }) {
+        select << "<option value='" << priority_name(p) << "'" << (p == selected ? " selected" : "") << ">";
+        select << priority_name(p) << " priority</option>";
+    }
+    select << "</select>";
+    return select.str();
+}
+
+const char* queue_state_name(DownloadManager::State state) {
+    switch (state) {
+    case DownloadManager::State::Queued: return "Queued";
+    case DownloadManager::State::Active: return "Downloading";
+    case DownloadManager::State::Pausing: return "Pausing";
+    default: return "Paused";
+    }
+}
+
 void setup_http_server(
     httplib::Server& http,
     const std::string& local_ip,
@@ -111,6 +145,23 @@ void setup_http_server(
         html << "<div class='info-card'><strong>P2P Port</strong>" << p2p_port << "</div>";
         html << "<div class='info-card'><strong>Tracker</strong>" << tracker_ip << ":" << tracker_port << "</div>";
         html << "<div class='info-card'><strong>Current Time</strong>" << get_current_time() << "</div>";
+        html << "<div class='info-card'><strong>Upload Rate</strong>"
+            << std::fixed << std::setprecision(1) << server_stats.chunks_per_sec.load() << " chunks/sec ("
+            << format_file_size(static_cast<uintmax_t>(server_stats.bytes_per_sec.load())) << "/s)</div>";
+        html << "<div class='info-card'><strong>Peer Connections</strong>" << server_stats.active_connections.load() << "</div>";
+        html << "<div class='info-card'><strong>Upload Slots</strong>"
+            << upload_slots.unchoked_count() << " unchoked / " << upload_slots.max_unchoked()
+            << ", " << upload_slots.queued_count() << " queued</div>";
+        html << "<div class='info-card'><strong>Chunk Cache</strong>"
+            << chunk_cache.hits() << " hits / " << chunk_cache.misses() << " misses ("
+            << chunk_cache.coalesced() << " coalesced), "
+            << format_file_size(chunk_cache.size_bytes()) << " of " << format_file_size(chunk_cache.capacity()) << "</div>";
+        BufferPool::Stats pool = buffer_pool.stats();
+        html << "<div class='info-card'><strong>Transfer Buffers</strong>"
+            << format_file_size(pool.in_use) << " in use (peak " << format_file_size(pool.peak_in_use) << "), "
+            << format_file_size(pool.allocated) << " allocated of " << format_file_size(pool.capacity) << "; "
+            << pool.acquires << " acquires, " << pool.allocations << " allocations, "
+            << pool.waits << " waits (" << pool.waiting << " waiting)</div>";
         html << "</div>";
 
         // Navigation buttons
@@ -141,11 +192,31 @@ void setup_http_server(
         html << "</div>";
         html << "<div class='form-row'>";
         html << "<input type='text' name='saveas' placeholder='Save as (optional)'>";
+        html << priority_select(Priority::Normal);
         html << "<button type='submit'>Download File</button>";
         html << "</div>";
         html << "</form>";
         html << "</div>";
 
+        // Bandwidth limits card
+        auto kb = [](const std::atomic<uint64_t>& rate) { return std::to_string(rate.load() / 1024); };
+        html << "<div class='card'>";
+        html << "<h2>Bandwidth Limits</h2>";
+        html << "<p>Rates in KB/s; 0 means unlimited. Changes apply immediately.</p>";
+        html << "<form action='/limits' method='post'>";
+        html << "<div class='form-row'>";
+        html << "<input type='text' name='global_upload' placeholder='Total upload' value='" << kb(rate_limits.global_upload) << "' title='Total upload'>";
+        html << "<input type='text' name='peer_upload' placeholder='Upload per peer' value='" << kb(rate_limits.peer_upload) << "' title='Upload per peer'>";
+        html << "</div>";
+        html << "<div class='form-row'>";
+        html << "<input type='text' name='global_download' placeholder='Total download' value='" << kb(rate_limits.global_download) << "' title='Total download'>";
+        html << "<input type='text' name='per_download' placeholder='Per download' value='" << kb(rate_limits.per_download) << "' title='Per download'>";
+        html << "<input type='text' name='peer_download' placeholder='Download per peer' value='" << kb(rate_limits.peer_download) << "' title='Download per peer'>";
+        html << "<button type='submit'>Apply Limits</button>";
+        html << "</div>";
+        html << "</form>";
+        html << "</div>";
+
         // Downloaded files list
         html << "<div class='card'>";
         html << "<h2>Your Downloaded Files</h2>";
@@ -154,7 +225,7 @@ void setup_http_server(
         html << "<ul class='file-list'>";
         try {
             for (const auto& entry : std::filesystem::directory_iterator("downloads")) {
-                if (entry.is_regular_file()) {
+                if (entry.is_regular_file() && !is_state_file(entry.path()) && !is_manifest_file(entry.path())) {
                     has_files = true;
                     html << "<li class='file-item'>";
                     html << "<span class='file-name'>" << entry.path().filename().string() << "</span>";
@@ -192,7 +263,7 @@ void setup_http_server(
         html << "<ul class='file-list'>";
         try {
             for (const auto& entry : std::filesystem::directory_iterator("shared_files")) {
-                if (entry.is_regular_file()) {
+                if (entry.is_regular_file() && !is_manifest_file(entry.path())) {
                     has_files = true;
                     html << "<li class='file-item'>";
                     html << "<span class='file-name'>" << entry.path().filename().string() << "</span>";
@@ -278,6 +349,11 @@ void setup_http_server(
                     );
                 }
 
+                // Hash it so leechers can verify what they download
+                if (!make_manifest(dest.string())) {
+                    throw std::runtime_error("could not hash " + dest.string());
+                }
+
                 // Register with tracker
                 success = register_with_retry(
                     tracker_ip, tracker_port,
@@ -328,24 +404,28 @@ void setup_http_server(
         std::string message;
         std::string status_class = "card";
         bool success = false;
+        Priority priority;
 
         if (filename.empty()) {
             message = "Error: No filename provided";
             status_class = "card error";
         }
+        else if (!parse_priority(req.get_param_value("priority"), priority)) {
+            message = "Error: Unknown priority";
+            status_class = "card error";
+        }
         else {
             auto peers = get_peers_from_tracker(tracker_ip, tracker_port, filename);
             if (peers.empty()) {
                 message = "Error: No peers found for this file. The file may not exist on the network.";
                 status_class = "card error";
             }
+            else if (!download_manager.add(peers, filename, saveas, p2p_port, tracker_ip, tracker_port, priority)) {
+                message = "Error: <strong>" + saveas + "</strong> is already in the download queue.";
+                status_class = "card error";
+            }
             else {
-                // Start download in separate thread to avoid blocking
-                std::thread download_thread([peers, filename, saveas, p2p_port, tracker_ip, tracker_port]() {
-                    run_leecher_parallel(peers, filename, saveas, p2p_port, tracker_ip, tracker_port);
-                    });
-                download_thread.detach();
-                message = "Download started for <strong>" + filename + "</strong>";
+                message = "Download queued for <strong>" + filename + "</strong>";
                 if (saveas != filename) {
                     message += " (saving as <strong>" + saveas + "</strong>)";
                 }
@@ -361,7 +441,7 @@ void setup_http_server(
 
         html << "<h2>Download Result</h2>";
         html << "<div class='" << status_class << "'>";
-        html << "<h3>" << (success ? "Download Started" : "Error") << "</h3>";
+        html << "<h3>" << (success ? "Download Queued" : "Error") << "</h3>";
         html << "<p>" << message << "</p>";
         html << "</div>";
 
@@ -375,6 +455,83 @@ void setup_http_server(
         res.set_content(html.str(), "text/html");
         });
 
+    // Handle bandwidth limit changes
+    http.Post("/limits", [](auto& req, auto& res) {
+        std::pair<const char*, std::atomic<uint64_t>*> fields[] = {
+            { "global_upload", &rate_limits.global_upload },
+            { "peer_upload", &rate_limits.peer_upload },
+            { "global_download", &rate_limits.global_download },
+            { "per_download", &rate_limits.per_download },
+            { "peer_download", &rate_limits.peer_download },
+        };
+
+        std::string message = "Bandwidth limits updated.";
+        std::string status_class = "card success";
+        for (auto& [name, rate] : fields) {
+            if (!req.has_param(name)) continue;
+            std::string value = req.get_param_value(name);
+            try {
+                rate->store(value.empty() ? 0 : std::stoull(value) * 1024);
+            }
+            catch (...) {
+                message = std::string("Error: invalid value for ") + name;
+                status_class = "card error";
+            }
+        }
+
+        std::stringstream html;
+        html << get_page_header("Bandwidth Limits");
+        html << "<h2>Bandwidth Limits</h2>";
+        html << "<div class='" << status_class << "'>";
+        html << "<p>" << message << "</p>";
+        html << "</div>";
+        html << "<div class='button-row'>";
+        html << "<a href='/' class='nav-link'>Back to Home</a>";
+        html << "</div>";
+        html << get_page_footer();
+        res.set_content(html.str(), "text/html");
+        });
+
+    // Restart an interrupted download from its saved state
+    http.Post("/resume", [p2p_port, tracker_ip, tracker_port](auto& req, auto& res) {
+        std::string saveas = req.get_param_value("saveas");
+        if (!download_manager.add_saved(saveas, p2p_port, tracker_ip, tracker_port)) {
+            std::stringstream html;
+            html << get_page_header("Resume Download");
+            html << "<h2>Resume Download</h2>";
+            html << "<div class='card error'>";
+            html << "<p>Error: could not resume <strong>" << saveas << "</strong>. ";
+            html << "Its saved state is missing or it is already queued.</p>";
+            html << "</div>";
+            html << "<div class='button-row'>";
+            html << "<a href='/progress' class='nav-link'>Back to Downloads</a>";
+            html << "</div>";
+            html << get_page_footer();
+            res.set_content(html.str(), "text/html");
+            return;
+        }
+        res.set_redirect("/progress");
+        });
+
+    // Queue controls; each takes effect at the download's next tune tick
+    http.Post("/downloads/pause", [](auto& req, auto& res) {
+        download_manager.pause(req.get_param_value("saveas"));
+        res.set_redirect("/progress");
+        });
+
+    http.Post("/downloads/resume", [](auto& req, auto& res) {
+        download_manager.resume(req.get_param_value("saveas"));
+        res.set_redirect("/progress");
+        });
+
+    http.Post("/downloads/priority", [](auto& req, auto& res) {
+        Priority priority;
+        if (parse_priority(req.get_param_value("priority"), priority)) {
+            download_manager.set_priority(req.get_param_value("saveas"), priority);
+        }
+        res.set_redirect("/progress");
+        });
+
     // Add progress endpoint to the HTTP server
     http.Get("/progress", [](auto& req, auto& res) {
         std::stringstream html;
@@ -384,6 +541,57 @@ void setup_http_server(
         html << "<h2>Active Downloads</h2>";
         html << "<p>This page refreshes automatically every 3 seconds.</p>";
 
+        // How long the last few chunks hold up a download
+        html << "<div class='card'>";
+        html << "<h3>Completion Tail</h3>";
+        html << "<p>Time from the last chunk being requested to the download finishing. ";
+        html << "Endgame mode is " << (leecher_endgame ? "on" : "off") << ".</p>";
+        html << "<table class='peer-table'>";
+        html << "<tr><th>Endgame</th><th>Downloads</th><th>p50</th><th>p99</th></tr>";
+        for (bool endgame : { true, false }) {
+            TailStats tail = tail_stats(endgame);
+            html << "<tr><td>" << (endgame ? "On" : "Off") << "</td><td>" << tail.count << "</td>";
+            if (tail.count == 0) {
+                html << "<td>-</td><td>-</td>";
+            }
+            else {
+                html << std::fixed << std::setprecision(0);
+                html << "<td>" << tail.p50_ms << " ms</td><td>" << tail.p99_ms << " ms</td>";
+            }
+            html << "</tr>";
+        }
+        html << "</table>";
+        html << "</div>";
+
+        // The queue: what runs, what waits, and at which priority
+        auto queue = download_manager.entries();
+        std::map<std::string, DownloadManager::State> queue_state;
+        html << "<div class='card'>";
+        html << "<h3>Download Queue</h3>";
+        html << "<p>Up to " << download_manager.max_active() << " downloads run at once; ";
+        html << "they share bandwidth and connections in proportion to their priority.</p>";
+        if (queue.empty()) {
+            html << "<p>The queue is empty.</p>";
+        }
+        else {
+            html << "<table class='peer-table'>";
+            html << "<tr><th>File</th><th>State</th><th>Priority</th><th></th></tr>";
+            for (const auto& e : queue) {
+                queue_state[e.save_fn] = e.state;
+                bool paused = e.state == DownloadManager::State::Pausing || e.state == DownloadManager::State::Paused;
+                html << "<tr><td>" << e.save_fn << "</td><td>" << queue_state_name(e.state) << "</td>";
+                html << "<td><form class='inline-form' action='/downloads/priority' method='post'>";
+                html << "<input type='hidden' name='saveas' value='" << e.save_fn << "'>";
+                html << priority_select(e.priority) << "<button type='submit'>Set</button></form></td>";
+                html << "<td><form class='inline-form' action='/downloads/" << (paused ? "resume" : "pause") << "' method='post'>";
+                html << "<input type='hidden' name='saveas' value='" << e.save_fn << "'>";
+                html << "<button type='submit'>" << (paused ? "Resume" : "Pause") << "</button></form></td>";
+                html << "</tr>";
+            }
+            html << "</table>";
+        }
+        html << "</div>";
+
         std::lock_guard<std::mutex> lock(downloads_mutex);
         if (active_downloads.empty()) {
             html << "<div class='card'>";
@@ -403,9 +611,20 @@ void setup_http_server(
                 html << "</h3>";
 
                 // Status badge
-                html << "<span class='badge " << (progress.finished ? "badge-success" : "badge-progress") << "'>";
-                html << (progress.finished ? "Completed" : "Downloading");
-                html << "</span>";
+                auto queued = queue_state.find(filename);
+                bool paused = queued != queue_state.end() && queued->second == DownloadManager::State::Paused;
+                if (progress.finished) {
+                    html << "<span class='badge badge-success'>Completed</span>";
+                }
+                else if (paused) {
+                    html << "<span class='badge badge-paused'>Paused</span>";
+                }
+                else if (progress.interrupted) {
+                    html << "<span class='badge badge-interrupted'>Interrupted</span>";
+                }
+                else {
+                    html << "<span class='badge badge-progress'>Downloading</span>";
+                }
 
                 // Progress information
                 html << "<p>Progress: " << progress.completed_chunks << " of " << progress.total_chunks << " chunks</p>";
@@ -418,6 +637,30 @@ void setup_http_server(
                 // Percentage display
                 html << "<p>" << std::fixed << std::setprecision(1) << percent << "% complete</p>";
 
+                if (progress.interrupted && queued == queue_state.end()) {
+                    html << "<form action='/resume' method='post'>";
+                    html << "<input type='hidden' name='saveas' value='" << filename << "'>";
+                    html << "<button type='submit'>Resume</button>";
+                    html << "</form>";
+                }
+
+                // Per-peer rates the chunk scheduler works from
+                if (!progress.peers.empty()) {
+                    html << "<table class='peer-table'>";
+                    html << "<tr><th>Peer</th><th>Rate</th><th>Latency</th><th>Chunks</th><th>Connections</th><th>Health</th></tr>";
+                    for (const auto& peer : progress.peers) {
+                        html << "<tr" << (peer.active ? "" : " class='peer-done'") << ">";
+                        html << "<td>" << peer.peer << "</td>";
+                        html << "<td>" << std::setprecision(2) << peer.rate / (1024.0 * 1024.0) << " MB/s</td>";
+                        html << "<td>" << std::setprecision(1) << peer.latency * 1000.0 << " ms</td>";
+                        html << "<td>" << peer.chunks << "</td>";
+                        html << "<td>" << peer.connections << "</td>";
+                        html << "<td>" << peer.health << "</td>";
+                        html << "</tr>";
+                    }
+                    html << "</table>";
+                }
+
                 html << "</div>";
             }
         }
@@ -8,6 +8,7 @@
 #include "common.h"
 #include "tracker_client.h"
 #include "leecher.h"
+#include "rate_limiter.h"
 
 
 
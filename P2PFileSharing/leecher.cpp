@@ -1,302 +1,1996 @@
 #include "leecher.h"
+#include "buffer_pool.h"
+#include "download_manager.h"
+#include "download_state.h"
+#include "local_chunks.h"
+#include "logger.h"
+#include <deque>
+#include <random>
+#include <set>
 
-void run_leecher_parallel(const std::vector<std::string>& all_peers,
-    const std::string& request_fn,
-    const std::string& save_fn,
-    unsigned short my_port,
-    const std::string& tracker_ip,
-    unsigned short tracker_port)
+size_t leecher_pipeline_depth = 0;
+size_t leecher_connections = 0;
+size_t leecher_max_connections = 128;
+size_t leecher_threads = 1;
+bool leecher_endgame = true;
+SyncPolicy leecher_sync_policy = SyncPolicy::Periodic;
+uint64_t leecher_sync_bytes = 64 * 1024 * 1024;
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+using Strand = boost::asio::strand<boost::asio::io_context::executor_type>;
+
+constexpr auto RESPONSE_TIMEOUT = std::chrono::seconds(10);
+
+// How long a peer may keep us choked before its requests go elsewhere
+constexpr auto CHOKED_TIMEOUT = std::chrono::seconds(60);
+
+// Peers asked for the file size at once when a download starts. Their
+// answers are votes on the size and manifest; the connections are kept.
+constexpr size_t RACE_PEERS = 3;
+
+// The votes are counted once MANIFEST_QUORUM peers agree on a manifest, or
+// MANIFEST_GRACE after the first answer arrived if the rest are slow
+constexpr size_t MANIFEST_QUORUM = 2;
+constexpr auto MANIFEST_GRACE = std::chrono::milliseconds(300);
+
+// A seeder without a manifest on disk builds one before answering
+constexpr auto MANIFEST_TIMEOUT = std::chrono::seconds(120);
+
+// A chunk that failed waits before it is handed out again, twice as long
+// after each failure. A peer that failed it CHUNK_PEER_RETRIES times isn't
+// asked for it again while another usable peer hasn't used up its tries.
+constexpr auto CHUNK_BACKOFF_BASE = std::chrono::milliseconds(100);
+constexpr auto CHUNK_BACKOFF_MAX = std::chrono::seconds(5);
+constexpr unsigned CHUNK_PEER_RETRIES = 2;
+constexpr unsigned BAD_SOURCE = static_cast<unsigned>(-1);  // sent data that failed verification
+
+// Connections per download: the adaptive count starts at one per peer up
+// to INITIAL_CONNECTIONS; MAX_DOWNLOAD_CONNECTIONS is its ceiling, and at
+// most MAX_PEER_CONNECTIONS of them go to the same peer
+constexpr size_t INITIAL_CONNECTIONS = 8;
+constexpr size_t MAX_DOWNLOAD_CONNECTIONS = 32;
+constexpr size_t MAX_PEER_CONNECTIONS = 4;
+constexpr auto TUNE_INTERVAL = std::chrono::seconds(1);
+
+// Sessions alive over all downloads, and the summed priority weights of the
+// downloads the connection budget and download limit are split between
+std::atomic<size_t> open_connections{ 0 };
+std::atomic<unsigned> running_weight{ 0 };
+
+// A peer slower than this fraction of the fastest one only gets a chunk
+// while it has nothing in flight, and only if it would finish that chunk
+// before the other peers could drain the rest of the queue
+constexpr double SLOW_PEER_FRACTION = 0.5;
+constexpr auto DEFER_RECHECK = std::chrono::milliseconds(200);
+
+// Peers still downloading the file are asked for their new chunks this often
+constexpr auto HAVE_INTERVAL = std::chrono::seconds(1);
+
+// A connection that can't be given any work while the whole download makes
+// no progress for this long is dropped
+constexpr auto STALL_TIMEOUT = std::chrono::seconds(30);
+
+// Most copies of one chunk requested at once during endgame
+constexpr size_t ENDGAME_COPIES = 3;
+
+// Tail times of recent downloads, [0] without endgame and [1] with it
+constexpr size_t TAIL_SAMPLES = 1000;
+std::mutex tail_mutex;
+std::vector<double> tail_samples[2];
+
+void record_tail(bool endgame, double ms)
 {
-    // DEBUG: show where we're writing
+    std::lock_guard lk(tail_mutex);
+    auto& samples = tail_samples[endgame];
+    if (samples.size() == TAIL_SAMPLES) samples.erase(samples.begin());
+    samples.push_back(ms);
+}
+
+
+enum class Pick { Assigned, Deferred, Empty };
+
+// Which chunks a peer holds, from its Bitfield reply and later Have replies
+struct PeerChunks
+{
+    bool all = false;
+    std::vector<bool> have;
+    uint64_t version = 0;
+};
+
+// Event loop shared by every download. It is started on first use and never
+// torn down: its threads keep running until the process exits.
+struct Engine
+{
+    boost::asio::io_context io;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> guard{ io.get_executor() };
+};
+
+boost::asio::io_context& engine()
+{
+    static Engine* e = [] {
+        auto* engine = new Engine;
+        for (size_t i = 0; i < std::max<size_t>(leecher_threads, 1); ++i) {
+            std::thread([engine]() {
+                for (;;) {
+                    try {
+                        engine->io.run();
+                        return;
+                    }
+                    catch (const std::exception& ex) {
+                        log_line(LogLevel::Error, "[Leecher] Engine error: ", ex.what());
+                    }
+                }
+                }).detach();
+        }
+        return engine;
+    }();
+    return e->io;
+}
+
+void register_download(const std::string& request_fn,
+    unsigned short my_port, const std::string& tracker_ip, unsigned short tracker_port);
+
+class PeerSession;
+
+// State of one download. Its handlers, and those of its peer sessions, all
+// run on `strand`, so none of this needs locking even when the engine has
+// several threads.
+struct Download : std::enable_shared_from_this<Download>
+{
+    Download(std::vector<std::string> peers, std::string request_fn, std::string save_fn,
+        unsigned short my_port, std::string tracker_ip, unsigned short tracker_port)
+        : strand(boost::asio::make_strand(engine())), peers(std::move(peers)),
+          request_fn(std::move(request_fn)), save_fn(std::move(save_fn)), my_port(my_port),
+          tracker_ip(std::move(tracker_ip)), tracker_port(tracker_port),
+          manifest_timer(strand),
+          conn_tuner(leecher_connections, std::min(this->peers.size(), INITIAL_CONNECTIONS), MAX_DOWNLOAD_CONNECTIONS),
+          tune_timer(strand)
     {
-        std::lock_guard lk(cout_mutex);
-        auto cwd = std::filesystem::current_path();
-        std::cout << "[Leecher] CWD = " << cwd << "\n"
-            << "          will write to: "
-            << (cwd / "downloads" / save_fn) << "\n";
     }
 
-    // Filter out self from peers
-    auto peers = all_peers;
-    std::string self_ep = get_local_ip() + ":" + std::to_string(my_port);
-    peers.erase(std::remove(peers.begin(), peers.end(), self_ep), peers.end());
-    if (peers.empty()) peers.push_back(self_ep);
+    void start();
 
-    // Get file size from peer
-    auto [ip0, port0] = [&]() {
-        auto p = peers[0];
-        auto pos = p.find(':');
-        return std::make_pair(p.substr(0, pos),
-            static_cast<unsigned short>(std::stoi(p.substr(pos + 1))));
-        }();
-
-    size_t filesize = get_filesize_from_peer(ip0, port0, request_fn);
-    if (!filesize) {
-        std::lock_guard lk(cout_mutex);
-        std::cerr << "[Leecher] Unable to get filesize for " << request_fn << "\n";
-        return;
+    // Keeps RACE_PEERS connections asking for the file size until the
+    // size is settled or every peer has been tried
+    void race();
+    void add_voter();
+
+    // Called once the peers' size votes are settled
+    bool set_size(size_t size);
+
+    // Every session that connects before the manifest is settled asks its
+    // peer for the size and a manifest, and parks with both (nullptr if the
+    // peer has no manifest). The size is settled by majority first, then the
+    // manifest among the peers that gave that size. Peers on the losing side
+    // of either are excluded; so is one whose late answer differs.
+    void manifest_answer(PeerSession* session, const std::string& peer, size_t size, ManifestPtr m);
+    void settle_manifest(bool grace_over);
+
+    // The manifest is settled (nullptr: none, chunks go unchecked): release
+    // the parked sessions and open connections to the other peers
+    void set_manifest(ManifestPtr m);
+    void open_peers();
+
+    // Connection count. Every TUNE_INTERVAL the aggregate rate goes to
+    // conn_tuner, and sessions are opened or retired to meet its target.
+    // New connections go to peers without one first, then to the peer with
+    // the best rate per connection. The same tick checks with
+    // download_manager for a pause or a new priority.
+    size_t connection_limit() const;
+    bool add_connection();
+    void retire_connection();
+    void schedule_tune();
+    void tune();
+
+    // Paused: close every connection, keeping the resume state
+    void stop();
+
+    // This download's level of the download rate limit: the per-download
+    // limit, and its priority's share of the global one
+    uint64_t rate_cap() const;
+
+    // Checks a received chunk against the manifest. `skip` bytes of it were
+    // received earlier and are already part of its saved hash state; Stale
+    // means another copy has moved that state on since this one was asked for.
+    enum class Check { Good, Bad, Stale };
+    Check verify(size_t idx, size_t skip, const char* data, size_t len) const;
+
+    // Discards a chunk that failed verification and queues it again for
+    // any peer but the one that sent it
+    void reject(PeerSession* owner, const std::string& peer, size_t idx);
+
+    // Peer health. Failures feed the peer's circuit breaker; when it trips,
+    // the peer's other connections hand their chunks back so healthy peers
+    // pick them up. peer_failed is true if this failure tripped it.
+    void peer_ok(const std::string& peer);
+    bool peer_failed(const std::string& peer);
+    void remove_peer(const std::string& peer);
+    const PeerHealth& health_of(const std::string& peer) { return health[peer]; }
+    bool usable(const std::string& peer, clock::time_point now) const;
+    void health_changed(const std::string& peer);
+
+    // Whether a peer's breaker is open but the peer may still come back
+    bool recovering() const;
+
+    // Whether `peer`, holding `chunks`, may be asked for chunk `idx`
+    bool can_fetch(const std::string& peer, const PeerChunks& chunks, size_t idx) const;
+
+    // Rarest chunk `peer` holds and how many of its bytes are already on
+    // disk. Deferred means there is work but none for this peer right now:
+    // it doesn't hold any of it, or it is slow and would be on the critical path.
+    //
+    // Once every chunk has been handed out, endgame starts: peers with spare
+    // pipeline slots get duplicates of chunks still in flight elsewhere, the
+    // first complete copy wins and the others are discarded as they arrive.
+    Pick next_chunk(PeerSession* owner, const std::string& peer, size_t inflight,
+        const PeerChunks& chunks, size_t& idx, size_t& skip);
+
+    // Records a completed chunk and the peer's measured rate and latency;
+    // other copies still in flight no longer count as holders
+    void chunk_done(PeerSession* owner, const std::string& peer, size_t idx, const PipelineTuner& tuner);
+    bool is_done(size_t idx) const { return done[idx]; }
+    void peer_ended(const std::string& peer);
+
+    // Availability bookkeeping as peers report chunks and disconnect
+    void peer_has(PeerChunks& peer, size_t idx);
+    void peer_has_all(PeerChunks& peer);
+    void peer_left(PeerChunks& peer);
+
+    // Queues a failed chunk again after its backoff, counting the failure
+    // against the owner's peer. Nothing is re-queued while another copy is
+    // still in flight.
+    void requeue(PeerSession* owner, size_t idx, const std::string& reason);
+
+    // Hands a chunk back without counting it as a failure
+    void release(PeerSession* owner, size_t idx);
+
+    // Removes `owner` from the chunk's holders; true if it was the last one
+    bool drop_owner(PeerSession* owner, size_t idx);
+
+    // Keep the bytes of a half-received chunk so its retry only fetches the
+    // rest. Only a copy that picked up where the saved part ends extends it.
+    void save_partial(size_t idx, size_t skip, const char* data, size_t len);
+
+    bool write_chunk(uint64_t offset, const char* data, size_t len);
+
+    // Records chunks in the resume state as leecher_sync_policy allows
+    void persist(bool force);
+
+    // The last session closed. The download ends unless a peer may still
+    // recover, in which case tune() keeps trying to reconnect.
+    void session_ended();
+    void end();
+
+    Strand strand;
+    const std::vector<std::string> peers;
+    const std::string request_fn;
+    const std::string save_fn;
+    const unsigned short my_port;
+    const std::string tracker_ip;
+    const unsigned short tracker_port;
+
+    std::string path() const { return (std::filesystem::path("downloads") / save_fn).string(); }
+
+    size_t filesize = 0;
+    size_t total_chunks = 0;
+    size_t completed = 0;
+    clock::time_point last_progress;
+    OutputFile out;
+    DownloadState state;
+    std::vector<size_t> unsynced;  // done, but not yet in the resume state
+
+    // Rarest-first work queue: chunks ordered by how many connected peers
+    // hold them. Peers with the whole file add to every chunk alike, so only
+    // partial peers are counted. Ties go in file order from a random first
+    // chunk, which keeps disk access sequential while leechers that start
+    // together still spread out over the file.
+    std::set<std::pair<uint32_t, size_t>> work;  // (availability, rank)
+    std::vector<uint32_t> availability;
+    std::vector<bool> queued;
+    std::vector<bool> done;
+    size_t first_chunk = 0;
+
+    // Sessions fetching each chunk that has been handed out
+    std::unordered_map<size_t, std::vector<PeerSession*>> in_flight;
+    clock::time_point tail_start;  // when the queue first ran empty
+
+    size_t rank(size_t idx) const { return (idx + total_chunks - first_chunk) % total_chunks; }
+    size_t chunk_at(size_t rank) const { return (rank + first_chunk) % total_chunks; }
+    void enqueue(size_t idx);
+    void add_availability(size_t idx, int delta);
+
+    std::unordered_map<size_t, size_t> resume_at;
+    ManifestPtr manifest;  // nullptr: no peer could provide one, chunks go unchecked
+    bool peers_opened = false;  // the manifest is settled and every peer has a session
+    bool sized = false;         // the file size is settled
+    size_t next_racer = 0;      // peers[] index the next size query goes to
+    std::vector<std::shared_ptr<PeerSession>> parked;  // connected, waiting for the manifest
+
+    struct ManifestVote
+    {
+        size_t size;
+        ManifestPtr manifest;  // nullptr: the peers have none
+        std::vector<std::string> peers;
+    };
+    std::vector<ManifestVote> manifest_votes;
+    size_t manifest_pending = 0;  // sessions that haven't answered yet
+    bool manifest_grace = false;
+    boost::asio::steady_timer manifest_timer;
+    std::unordered_map<size_t, Sha256> partial_hash;  // hash state of resume_at's bytes
+
+    // Chunks that failed: when they may be handed out again, and how often
+    // each peer failed them
+    struct ChunkRetry
+    {
+        unsigned attempts = 0;
+        clock::time_point not_before;
+        std::map<std::string, unsigned> by_peer;
+    };
+    std::unordered_map<size_t, ChunkRetry> retries;
+    std::vector<PeerProgress> peer_stats;
+
+    // Per-download level of the download rate limit hierarchy
+    TokenBucket bucket;
+
+    size_t sessions = 0;
+    size_t connections_opened = 0;
+
+    std::vector<PeerSession*> live;  // sessions that haven't finished
+    std::map<std::string, PeerHealth> health;
+    ConnectionTuner conn_tuner;
+    boost::asio::steady_timer tune_timer;
+    unsigned weight = static_cast<unsigned>(Priority::Normal);
+    bool stopping = false;
+    bool ended = false;
+    uint64_t bytes_done = 0;  // by chunk_done, for the rate conn_tuner sees
+    uint64_t bytes_at_tune = 0;
+    size_t failures = 0;      // requests that failed on established connections since the last tune
+    clock::time_point last_tune;
+};
+
+// One pipelined connection to a peer, driven entirely by async operations.
+// The first session of a download also asks the peer for the file size.
+// Requests are written as soon as there is room in the pipeline, and the
+// responses, which arrive strictly in order, are read one at a time into a
+// single chunk buffer. Each connection attempt gets a new generation number
+// so late completions from a closed socket are ignored.
+class PeerSession : public std::enable_shared_from_this<PeerSession>
+{
+public:
+    PeerSession(std::shared_ptr<Download> download, std::string peer)
+        : download_(std::move(download)), peer_(std::move(peer)),
+          sock_(download_->strand), deadline_(download_->strand), throttle_(download_->strand),
+          tuner_(leecher_pipeline_depth), bucket_(peer_download_bucket(peer_))
+    {
+        std::tie(ip_, port_) = split_peer(peer_);
+        ++download_->sessions;
+        download_->live.push_back(this);
+        ++open_connections;
+
+        auto& stats = download_->peer_stats;
+        auto it = std::find_if(stats.begin(), stats.end(), [&](const PeerProgress& p) { return p.peer == peer_; });
+        if (it == stats.end()) it = stats.insert(stats.end(), PeerProgress{ peer_ });
+        it->active = true;
+        ++it->connections;
     }
 
-    size_t total_chunks = (filesize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    void start() { connect(); }
 
-    // Initialize progress tracking
+    const std::string& peer() const { return peer_; }
+    double rate() const { return tuner_.rate(); }
+    bool retiring() const { return retiring_; }
+
+    // The download has more connections than it needs: stop taking work
+    // and close once what is in flight has arrived
+    void retire() { retiring_ = true; }
+
+    // A session whose answers are votes on the size and manifest. It counts
+    // as pending from the start, so the vote waits for it even if it never
+    // connects.
+    void start_voter()
     {
-        std::lock_guard lk(downloads_mutex);
-        auto& dp = active_downloads[save_fn];
-        dp.filename = request_fn;
-        dp.total_chunks = total_chunks;
-        dp.completed_chunks = 0;
-        dp.finished = false;
+        fetching_manifest_ = true;
+        ++download_->manifest_pending;
+        start();
     }
 
-    // Create download directory if it doesn't exist
-    std::filesystem::create_directory("downloads");
+    // Parked until the manifest was settled; now fetch like any other,
+    // unless the peer was excluded meanwhile
+    void unpark()
+    {
+        if (finished_) return;
+        if (!download_->usable(peer_, clock::now())) return finish();
+        request_bitfield();
+    }
 
-    // Open output file - don't pre-size it
-    std::ofstream out("downloads/" + save_fn, std::ios::binary | std::ios::trunc);
-    if (!out) {
-        std::lock_guard lk(cout_mutex);
-        std::cerr << "[Leecher] Failed to open output file: downloads/" << save_fn << "\n";
-        return;
+    // The download is paused: hand the pipeline back and close now
+    void stop()
+    {
+        for (const auto& p : inflight_) {
+            if (p.idx != HAVE_POLL) download_->release(this, p.idx);
+        }
+        inflight_.clear();
+        finish();
     }
 
-    // Create work queue for chunks
-    std::queue<size_t> work;
-    for (size_t i = 0; i < total_chunks; ++i) work.push(i);
-
-    // Mutexes for thread safety
-    std::mutex work_mutex, file_mutex;
-
-    // Determine how many threads to use
-    size_t max_threads = std::min<size_t>(peers.size(), 8);
-
-    // Track failed chunks to retry
-    std::vector<size_t> failed_chunks;
-    std::mutex failed_chunks_mutex;
-    int max_retries = 3;
-
-    // Create worker threads
-    std::vector<std::thread> pool;
-    for (size_t t = 0; t < max_threads; ++t) {
-        pool.emplace_back([&]() {
-            while (true) {
-                size_t idx;
-                { // Get next chunk from work queue
-                    std::lock_guard lk(work_mutex);
-                    if (work.empty()) break;
-                    idx = work.front();
-                    work.pop();
-                }
+private:
+    struct Pending { size_t idx; size_t skip; clock::time_point sent; };
 
-                // Select peer using round-robin
-                auto [ip, port] = [&]() {
-                    auto p = peers[idx % peers.size()];
-                    auto pos = p.find(':');
-                    return std::make_pair(p.substr(0, pos),
-                        static_cast<unsigned short>(std::stoi(p.substr(pos + 1))));
-                    }();
-
-                try {
-                    // Set up connection to peer
-                    boost::asio::io_context io;
-                    tcp::socket sock(io);
-
-                    // Add connection timeout
-                    sock.connect({ boost::asio::ip::make_address(ip), port });
-
-                    // Set operation timeout
-                   // Set socket receive timeout (platform dependent)
-#ifdef _WIN32
-    // Windows-specific
-                    DWORD timeout_ = 5000; // 5 seconds in milliseconds
-                    setsockopt(sock.native_handle(), SOL_SOCKET, SO_RCVTIMEO,
-                        (const char*)&timeout_, sizeof(timeout_));
-#else
-    // POSIX systems (Linux, macOS, etc.)
-                    struct timeval tv;
-                    tv.tv_sec = 5;  // 5 seconds
-                    tv.tv_usec = 0;
-                    setsockopt(sock.native_handle(), SOL_SOCKET, SO_RCVTIMEO,
-                        (const char*)&tv, sizeof(tv));
-#endif
-                    // Request specific chunk
-                    std::string req = "SENDCHUNK " + request_fn + " " + std::to_string(idx) + "\n";
-                    boost::asio::write(sock, boost::asio::buffer(req));
-
-                    // Calculate chunk size - last chunk may be smaller
-                    size_t need = std::min(CHUNK_SIZE, filesize - idx * CHUNK_SIZE);
-                    std::vector<char> buf(need);
-                    size_t got = 0;
-                    boost::system::error_code ec;
-
-                    // Read with timeout
-                    auto start_time = std::chrono::steady_clock::now();
-                    bool timeout = false;
-
-                    while (got < need) {
-                        size_t n = sock.read_some(boost::asio::buffer(buf.data() + got, need - got), ec);
-
-                        if (ec) {
-                            if (ec != boost::asio::error::eof) {
-                                std::lock_guard lk(cout_mutex);
-                                std::cerr << "[Leecher] Read error: " << ec.message() << "\n";
-                                break;
-                            }
-                            // EOF is expected when chunk is complete
-                            break;
-                        }
+    // Pending entry for a Have request rather than a chunk
+    static constexpr size_t HAVE_POLL = static_cast<size_t>(-1);
 
-                        got += n;
+    void connect()
+    {
+        ++generation_;
+        reading_ = writing_ = throttled_ = have_pending_ = held_ = choked_ = established_ = false;
+        buf_ = PooledBuffer();
+        sock_ = tcp::socket(download_->strand);
+        arm(CONNECT_TIMEOUT);
 
-                        // Check for timeout (10 seconds total)
-                        auto now = std::chrono::steady_clock::now();
-                        if (std::chrono::duration_cast<std::chrono::seconds>(now - start_time).count() > 10) {
-                            timeout = true;
-                            std::lock_guard lk(cout_mutex);
-                            std::cerr << "[Leecher] Timeout getting chunk " << idx << "\n";
-                            break;
-                        }
-                    }
+        auto self = shared_from_this();
+        tcp::endpoint ep(boost::asio::ip::make_address(ip_), port_);
+        sock_.async_connect(ep, [self, gen = generation_](const boost::system::error_code& ec) {
+            if (gen != self->generation_) return;
+            if (ec) return self->fail(self->timed_out_ ? std::string("connect: timed out") : "connect: " + ec.message());
+            boost::system::error_code opt_ec;
+            self->sock_.set_option(tcp::no_delay(true), opt_ec);
+            self->established_ = true;
+            ++self->download_->connections_opened;
+            if (self->text_only_) self->connected();
+            else self->handshake();
+        });
+    }
 
-                    // Only write if we got all expected data
-                    if (got == need) {
-                        // Write chunk to file
-                        {
-                            std::lock_guard lk(file_mutex);
-                            out.seekp(idx * CHUNK_SIZE);
-                            if (!out) {
-                                std::lock_guard log_lk(cout_mutex);
-                                std::cerr << "[Leecher] Error seeking to position " << (idx * CHUNK_SIZE) << "\n";
-
-                                // Add to failed chunks
-                                std::lock_guard fc_lk(failed_chunks_mutex);
-                                failed_chunks.push_back(idx);
-                                continue;
-                            }
-
-                            out.write(buf.data(), got);
-                            if (!out) {
-                                std::lock_guard log_lk(cout_mutex);
-                                std::cerr << "[Leecher] Error writing chunk " << idx << "\n";
-
-                                std::lock_guard fc_lk(failed_chunks_mutex);
-                                failed_chunks.push_back(idx);
-                                continue;
-                            }
-
-                            out.flush(); // Force write to disk
-                        }
+    // Peers that don't know the handshake treat it as a request for a file
+    // called "HELLO" and hang up, so the text protocol needs a fresh socket
+    void handshake()
+    {
+        arm(RESPONSE_TIMEOUT);
+        auto self = shared_from_this();
+        write_buf_ = "HELLO " + std::to_string(PROTOCOL_VERSION) + "\n";
+        boost::asio::async_write(sock_, boost::asio::buffer(write_buf_),
+            [self, gen = generation_](const boost::system::error_code& ec, size_t) {
+                if (gen != self->generation_) return;
+                if (ec) return self->fail("handshake: " + ec.message());
 
-                        // Update progress
-                        {
-                            std::lock_guard lk(downloads_mutex);
-                            auto& dp = active_downloads[save_fn];
-                            if (++dp.completed_chunks == dp.total_chunks)
-                                dp.finished = true;
+                self->line_.clear();
+                boost::asio::async_read_until(self->sock_, boost::asio::dynamic_buffer(self->line_, 64), '\n',
+                    [self, gen](const boost::system::error_code& ec, size_t n) {
+                        if (gen != self->generation_) return;
+                        if (!ec && self->line_.substr(0, n) == self->write_buf_) {
+                            self->framed_ = true;
+                            self->connected();
+                            return;
                         }
+                        self->text_only_ = true;
+                        self->connect();
+                    });
+            });
+    }
+
+    void connected()
+    {
+        disarm();
+        if (download_->total_chunks == 0) return query_size();
+        size_ = download_->filesize;
+        await_manifest();
+    }
+
+    // Until the size is settled the answer is a vote that goes in with the
+    // manifest; after that it has to match
+    void on_size(size_t size)
+    {
+        disarm();
+        Download& d = *download_;
+        if (size == 0) {
+            log_line(LogLevel::Warn, "[Leecher] ", peer_, " doesn't have ", d.request_fn);
+            d.remove_peer(peer_);
+            d.race();
+            return finish();
+        }
+        size_ = size;
+        if (d.sized && d.total_chunks == 0) return finish();
+        if (d.sized && size != d.filesize) {
+            log_line(LogLevel::Warn, "[Leecher] ", peer_, " reports ", size, " bytes for ", d.request_fn,
+                ", not ", d.filesize, "; leaving it out");
+            d.remove_peer(peer_);
+            return finish();
+        }
+        await_manifest();
+    }
+
+    void await_manifest()
+    {
+        if (download_->peers_opened) return request_bitfield();
+        request_manifest();
+    }
+
+    // One framed request for the download's file
+    std::string frame(Opcode op, uint64_t index, uint64_t arg = 0) const
+    {
+        const std::string& fn = download_->request_fn;
+        FrameHeader h;
+        h.opcode = op;
+        h.length = static_cast<uint32_t>(fn.size());
+        h.index = index;
+        h.arg = arg;
+        std::string out(FRAME_HEADER_SIZE, '\0');
+        h.encode(&out[0]);
+        return out + fn;
+    }
+
+    // Reads a whole control response (header into header_, payload into line_)
+    template <typename Handler>
+    void read_reply(Handler handler)
+    {
+        auto self = shared_from_this();
+        boost::asio::async_read(sock_, boost::asio::buffer(header_),
+            [self, gen = generation_, handler](const boost::system::error_code& ec, size_t) {
+                if (gen != self->generation_) return;
+                if (ec) return self->fail("read error: " + ec.message());
+                FrameHeader h = FrameHeader::decode(self->header_);
+                size_t chunks = (self->size_ + CHUNK_SIZE - 1) / CHUNK_SIZE;
+                if (h.length > chunks * Sha256::DIGEST_SIZE + MAX_REQUEST_PAYLOAD) {
+                    return self->fail("oversized reply (" + std::to_string(h.length) + " bytes)");
+                }
+                self->line_.assign(h.length, '\0');
+                boost::asio::async_read(self->sock_, boost::asio::buffer(self->line_),
+                    [self, gen, handler, h](const boost::system::error_code& ec, size_t) {
+                        if (gen != self->generation_) return;
+                        if (ec) return self->fail("read error: " + ec.message());
+                        handler(h);
+                    });
+            });
+    }
+
+    void query_size()
+    {
+        auto self = shared_from_this();
+        arm(RESPONSE_TIMEOUT);
+        if (framed_) {
+            write_buf_ = frame(Opcode::FileSize, 0);
+        }
+        else {
+            write_buf_ = "FILESIZE " + download_->request_fn + "\n";
+        }
+
+        boost::asio::async_write(sock_, boost::asio::buffer(write_buf_),
+            [self, gen = generation_](const boost::system::error_code& ec, size_t) {
+                if (gen != self->generation_) return;
+                if (ec) return self->fail("FILESIZE: " + ec.message());
+
+                auto on_size = [self](size_t size) { self->on_size(size); };
+                if (self->framed_) {
+                    boost::asio::async_read(self->sock_, boost::asio::buffer(self->header_),
+                        [self, gen, on_size](const boost::system::error_code& ec, size_t) {
+                            if (gen != self->generation_) return;
+                            if (ec) return self->fail("FILESIZE: " + ec.message());
+                            FrameHeader h = FrameHeader::decode(self->header_);
+                            if (h.status != Status::Ok || h.length != 0) return on_size(0);
+                            on_size(static_cast<size_t>(h.arg));
+                        });
+                    return;
+                }
+                self->line_.clear();
+                boost::asio::async_read_until(self->sock_, boost::asio::dynamic_buffer(self->line_, 64), '\n',
+                    [self, gen, on_size](const boost::system::error_code& ec, size_t n) {
+                        if (gen != self->generation_) return;
+                        if (ec) return self->fail("FILESIZE: " + ec.message());
+                        try { on_size(std::stoull(self->line_.substr(0, n))); }
+                        catch (...) { on_size(0); }
+                    });
+            });
+    }
+
+    // Fetches this peer's manifest for the vote. A peer without one votes
+    // on the size alone; one whose manifest doesn't match the size it gave
+    // is left out.
+    void request_manifest()
+    {
+        if (!fetching_manifest_) {
+            fetching_manifest_ = true;
+            ++download_->manifest_pending;
+        }
+        if (!framed_) return manifest_done(nullptr);
 
-                        std::lock_guard lk(cout_mutex);
-                        std::cout << "[Leecher] Chunk " << idx
-                            << " from " << ip << ":" << port
-                            << " (" << got << "/" << need << ")\n";
+        arm(MANIFEST_TIMEOUT);
+        write_buf_ = frame(Opcode::Manifest, 0);
+        auto self = shared_from_this();
+        boost::asio::async_write(sock_, boost::asio::buffer(write_buf_),
+            [self, gen = generation_](const boost::system::error_code& ec, size_t) {
+                if (gen != self->generation_) return;
+                if (ec) return self->fail("MANIFEST: " + ec.message());
+                self->read_reply([self](const FrameHeader& h) {
+                    self->disarm();
+                    if (h.status != Status::Ok) {
+                        log_line(LogLevel::Info, "[Leecher] No manifest from ", self->peer_, ": ",
+                            PeerStatusError(h.status, self->line_).what());
+                        return self->manifest_done(nullptr);
                     }
-                    else {
-                        // Re-queue failed chunk if haven't retried too many times
-                        std::lock_guard fc_lk(failed_chunks_mutex);
-                        if (std::find(failed_chunks.begin(), failed_chunks.end(), idx) == failed_chunks.end()) {
-                            std::lock_guard lk(work_mutex);
-                            work.push(idx);
-                            failed_chunks.push_back(idx);
-
-                            std::lock_guard log_lk(cout_mutex);
-                            std::cerr << "[Leecher] Incomplete chunk " << idx
-                                << " (" << got << "/" << need << "). Re-queuing.\n";
-                        }
-                        else {
-                            std::lock_guard log_lk(cout_mutex);
-                            std::cerr << "[Leecher] Chunk " << idx << " failed multiple times. Giving up.\n";
-                        }
+
+                    auto m = std::make_shared<Manifest>();
+                    std::string problem;
+                    if (!Manifest::decode(self->line_, *m)) problem = "malformed";
+                    else if (m->filesize != self->size_ || m->chunk_size != CHUNK_SIZE)
+                        problem = "describes a different file";
+                    if (!problem.empty()) {
+                        log_line(LogLevel::Warn, "[Leecher] Manifest from ", self->peer_, " ", problem,
+                            "; excluding it from ", self->download_->save_fn);
+                        self->download_->remove_peer(self->peer_);
+                        return self->finish();
                     }
-                }
-                catch (const std::exception& e) {
-                    // Re-queue failed chunk if haven't retried too many times
-                    std::lock_guard fc_lk(failed_chunks_mutex);
-                    if (std::find(failed_chunks.begin(), failed_chunks.end(), idx) == failed_chunks.end()) {
-                        std::lock_guard lk(work_mutex);
-                        work.push(idx);
-                        failed_chunks.push_back(idx);
-
-                        std::lock_guard log_lk(cout_mutex);
-                        std::cerr << "[Leecher] Chunk " << idx << " failed: " << e.what()
-                            << ". Re-queuing.\n";
+                    self->manifest_done(std::move(m));
+                });
+            });
+    }
+
+    void manifest_done(ManifestPtr m)
+    {
+        fetching_manifest_ = false;
+        --download_->manifest_pending;
+        download_->manifest_answer(this, peer_, size_, std::move(m));
+    }
+
+    // Asks the peer which chunks it holds. Text-only peers, and framed ones
+    // from before bitfields existed, are taken to have the whole file.
+    void request_bitfield()
+    {
+        if (!framed_) {
+            download_->peer_has_all(chunks_);
+            return pump();
+        }
+
+        arm(RESPONSE_TIMEOUT);
+        write_buf_ = frame(Opcode::Bitfield, 0);
+        auto self = shared_from_this();
+        boost::asio::async_write(sock_, boost::asio::buffer(write_buf_),
+            [self, gen = generation_](const boost::system::error_code& ec, size_t) {
+                if (gen != self->generation_) return;
+                if (ec) return self->fail("BITFIELD: " + ec.message());
+                self->read_reply([self](const FrameHeader& h) {
+                    self->disarm();
+                    if (h.status == Status::BadRequest || (h.status == Status::Ok && h.length == 0)) {
+                        self->download_->peer_has_all(self->chunks_);
+                    }
+                    else if (h.status != Status::Ok) {
+                        log_line(LogLevel::Warn, "[Leecher] ", self->peer_, " doesn't have ",
+                            self->download_->request_fn, ": ", PeerStatusError(h.status, self->line_).what());
+                        self->download_->remove_peer(self->peer_);
+                        return self->finish();
                     }
                     else {
-                        std::lock_guard log_lk(cout_mutex);
-                        std::cerr << "[Leecher] Chunk " << idx << " failed multiple times. Giving up.\n";
+                        for (size_t i = 0; i < self->download_->total_chunks && i / 8 < self->line_.size(); ++i) {
+                            if (static_cast<unsigned char>(self->line_[i / 8]) & (0x80 >> (i % 8)))
+                                self->download_->peer_has(self->chunks_, i);
+                        }
+                        self->chunks_.version = h.arg;
                     }
-                }
-            }
+                    self->last_have_ = clock::now();
+                    self->pump();
+                });
             });
     }
 
-    // Wait for all worker threads to finish
-    for (auto& th : pool) th.join();
+    // Tops the pipeline up to the current depth and keeps one read going
+    void pump()
+    {
+        if (!sock_.is_open()) return;
+
+        size_t idx, skip;
+        Pick pick = Pick::Empty;
+        while (!retiring_ && inflight_.size() < tuner_.depth() &&
+            (pick = download_->next_chunk(this, peer_, inflight_.size(), chunks_, idx, skip)) == Pick::Assigned) {
+            inflight_.push_back({ idx, skip, clock::now() });
+            append_request(idx, skip);
+        }
+
+        // A peer that is still downloading gets polled for its new chunks
+        if (framed_ && !retiring_ && !chunks_.all && !have_pending_ && clock::now() - last_have_ >= HAVE_INTERVAL) {
+            have_pending_ = true;
+            inflight_.push_back({ HAVE_POLL, 0, clock::now() });
+            pending_out_ += frame(Opcode::Have, chunks_.version);
+        }
+
+        if (!writing_ && !pending_out_.empty()) {
+            writing_ = true;
+            write_buf_.swap(pending_out_);
+            pending_out_.clear();
+
+            auto self = shared_from_this();
+            boost::asio::async_write(sock_, boost::asio::buffer(write_buf_),
+                [self, gen = generation_](const boost::system::error_code& ec, size_t) {
+                    if (gen != self->generation_) return;
+                    self->writing_ = false;
+                    if (ec) return self->fail("write error: " + ec.message());
+                    self->pump();
+                });
+        }
 
-    // Close the output file
-    out.close();
+        if (inflight_.empty() && pick == Pick::Deferred) {
+            if (clock::now() - download_->last_progress < STALL_TIMEOUT) return wait(DEFER_RECHECK);
+            log_line(LogLevel::Warn, "[Leecher] No work for ", peer_, " and no progress for ",
+                std::chrono::duration_cast<std::chrono::seconds>(STALL_TIMEOUT).count(), "s, disconnecting");
+        }
+        if (inflight_.empty()) return finish();
+        if (!reading_ && !throttled_) read_response();
+    }
 
-    // Verify file integrity
-    try {
-        std::string file_path = "downloads/" + save_fn;
-        std::ifstream verify_file(file_path, std::ios::binary);
-        if (!verify_file) {
-            std::lock_guard lk(cout_mutex);
-            std::cerr << "[Leecher] Could not open file for verification\n";
+    void append_request(size_t idx, size_t skip)
+    {
+        const std::string& fn = download_->request_fn;
+        size_t chunk_len = std::min(CHUNK_SIZE, download_->filesize - idx * CHUNK_SIZE);
+        if (framed_) {
+            pending_out_ += skip == 0
+                ? frame(Opcode::Chunk, idx)
+                : frame(Opcode::Range, idx * CHUNK_SIZE + skip, chunk_len - skip);
         }
         else {
-            verify_file.seekg(0, std::ios::end);
-            size_t actual_size = verify_file.tellg();
-            verify_file.close();
-
-            std::lock_guard lk(cout_mutex);
-            if (actual_size != filesize) {
-                std::cerr << "[Leecher] WARNING: File size mismatch! Expected: "
-                    << filesize << ", Got: " << actual_size << "\n";
+            pending_out_ += skip == 0
+                ? "SENDCHUNK " + fn + " " + std::to_string(idx) + "\n"
+                : "RANGE " + fn + " " + std::to_string(idx * CHUNK_SIZE + skip) +
+                  " " + std::to_string(chunk_len - skip) + "\n";
+        }
+    }
+
+    size_t expected_len() const
+    {
+        const Pending& p = inflight_.front();
+        return std::min(CHUNK_SIZE, download_->filesize - p.idx * CHUNK_SIZE) - p.skip;
+    }
+
+    void read_response()
+    {
+        reading_ = true;
+        arm(RESPONSE_TIMEOUT);
+        if (inflight_.front().idx == HAVE_POLL) return read_have();
+        if (!framed_) return read_body(0);
+        read_header();
+    }
+
+    // Framed peers report errors explicitly instead of hanging up, and say
+    // when they hold a reply back (choked, or over their upload limit)
+    void read_header()
+    {
+        auto self = shared_from_this();
+        boost::asio::async_read(sock_, boost::asio::buffer(header_),
+            [self, gen = generation_](const boost::system::error_code& ec, size_t) {
+                if (gen != self->generation_) return;
+                if (ec && self->choked_ && self->timed_out_) {
+                    log_line(LogLevel::Info, "[Leecher] Still choked by ", self->peer_, " after ",
+                        std::chrono::duration_cast<std::chrono::seconds>(CHOKED_TIMEOUT).count(),
+                        "s; its requests go to other peers");
+                    return self->stop();
+                }
+                if (ec) return self->fail("read error: " + ec.message());
+
+                FrameHeader h = FrameHeader::decode(self->header_);
+                if (h.status == Status::Choked || h.status == Status::Throttled) {
+                    // Waiting for an upload slot or the seeder's upload limit
+                    // is its policy, not a failure: a longer deadline and no
+                    // health penalty
+                    self->held_ = true;
+                    self->choked_ = h.status == Status::Choked;
+                    self->arm(self->choked_ ? clock::duration(CHOKED_TIMEOUT) :
+                        std::chrono::milliseconds(h.arg) + RESPONSE_TIMEOUT);
+                    return self->read_header();
+                }
+                if (self->held_) {
+                    // Time spent held back isn't latency
+                    self->held_ = self->choked_ = false;
+                    self->inflight_.front().sent = clock::now();
+                    self->arm(RESPONSE_TIMEOUT);
+                }
+                self->first_byte_ = clock::now();
+
+                if (h.status != Status::Ok) return self->read_error_reply(h);
+                if (h.length != self->expected_len()) {
+                    return self->fail("peer sent " + std::to_string(h.length) +
+                        " bytes, expected " + std::to_string(self->expected_len()));
+                }
+                self->read_body(0);
+            });
+    }
+
+    void read_have()
+    {
+        auto self = shared_from_this();
+        read_reply([self](const FrameHeader& h) {
+            self->disarm();
+            self->reading_ = false;
+            self->have_pending_ = false;
+            self->last_have_ = clock::now();
+            self->inflight_.pop_front();
+
+            if (h.status == Status::Ok) {
+                if (h.index == 1) self->download_->peer_has_all(self->chunks_);
+                for (size_t i = 0; i + 8 <= self->line_.size(); i += 8) {
+                    uint64_t idx = 0;
+                    for (size_t b = 0; b < 8; ++b) idx = (idx << 8) | static_cast<unsigned char>(self->line_[i + b]);
+                    self->download_->peer_has(self->chunks_, static_cast<size_t>(idx));
+                }
+                self->chunks_.version = h.arg;
             }
-            else {
-                std::cout << "[Leecher] File integrity check passed: " << actual_size << " bytes\n";
-
-                // Run deeper verification
-                if (verify_file_integrity(file_path, filesize)) {
-                    // Get local IP for registration
-                    std::string local_ip = get_local_ip();
-
-                    // Auto-register the file with the tracker after successful download
-                    std::thread([request_fn, tracker_ip, tracker_port, local_ip, my_port]() {
-                        // Register the downloaded file with the tracker so it can be shared
-                        bool registered = register_with_retry(
-                            tracker_ip, tracker_port,
-                            request_fn,  // Use original filename for registration
-                            local_ip, my_port);
-
-                        std::lock_guard log_lk(cout_mutex);
-                        if (registered) {
-                            std::cout << "[AutoSeeder] Successfully registered downloaded file: "
-                                << request_fn << " for seeding\n";
-                        }
-                        else {
-                            std::cerr << "[AutoSeeder] Failed to register file: " << request_fn << "\n";
-                        }
-                        }).detach();
+            self->pump();
+        });
+    }
+
+    // Only this request failed; the connection is still in sync
+    void read_error_reply(const FrameHeader& h)
+    {
+        auto self = shared_from_this();
+        line_.assign(std::min<uint32_t>(h.length, MAX_REQUEST_PAYLOAD), '\0');
+        boost::asio::async_read(sock_, boost::asio::buffer(line_),
+            [self, gen = generation_, status = h.status](const boost::system::error_code& ec, size_t) {
+                if (gen != self->generation_) return;
+                if (ec) return self->fail("read error: " + ec.message());
+
+                self->disarm();
+                self->reading_ = false;
+                self->download_->requeue(self.get(), self->inflight_.front().idx, PeerStatusError(status, self->line_).what());
+                self->inflight_.pop_front();
+                ++self->download_->failures;
+                if (self->download_->peer_failed(self->peer_)) return self->give_up();
+                self->pump();
+            });
+    }
+
+    void read_body(size_t got)
+    {
+        auto self = shared_from_this();
+
+        // The response stays in the socket until a buffer is free; the
+        // response timeout is paused meanwhile, since it isn't the peer's fault
+        if (!buf_) {
+            disarm();
+            buffer_pool.async_acquire(download_->strand, [self, gen = generation_](PooledBuffer b) {
+                if (gen != self->generation_) return;
+                self->buf_ = std::move(b);
+                self->arm(RESPONSE_TIMEOUT);
+                self->read_body(0);
+            });
+            return;
+        }
+
+        size_t need = expected_len();
+        sock_.async_read_some(boost::asio::buffer(buf_.data() + got, need - got),
+            [self, gen = generation_, got, need](const boost::system::error_code& ec, size_t n) {
+                if (gen != self->generation_) return;
+                if (got == 0 && n > 0 && !self->framed_) self->first_byte_ = clock::now();
+                size_t total = got + n;
+
+                // EOF before the chunk is complete means the peer dropped the request
+                if (ec) {
+                    const Pending& p = self->inflight_.front();
+                    if (total > 0) self->download_->save_partial(p.idx, p.skip, self->buf_.data(), total);
+                    self->buf_ = PooledBuffer();
+                    return self->fail(self->timed_out_ ? std::string("timeout") : "read error: " + ec.message());
                 }
+                if (total < need) return self->read_body(total);
+                self->on_chunk(total);
+            });
+    }
+
+    void on_chunk(size_t got)
+    {
+        PooledBuffer buf = std::move(buf_);  // back to the pool once written
+        disarm();
+        reading_ = false;
+        Pending p = inflight_.front();
+        inflight_.pop_front();
+
+        auto done = clock::now();
+        auto since = p.sent > last_done_ ? p.sent : last_done_;
+        tuner_.on_response(std::chrono::duration<double>(first_byte_ - p.sent).count(),
+            got, std::chrono::duration<double>(done - since).count());
+        last_done_ = done;
+
+        // Another endgame copy got here first
+        if (download_->is_done(p.idx)) {
+            download_->drop_owner(this, p.idx);
+            return pump();
+        }
+
+        // Hashed while still in memory; a bad chunk never reaches the disk
+        switch (download_->verify(p.idx, p.skip, buf.data(), got)) {
+        case Download::Check::Good:
+            break;
+        case Download::Check::Stale:
+            // Resumed from a point another copy has moved past; not the peer's fault
+            download_->release(this, p.idx);
+            return pump();
+        case Download::Check::Bad:
+            download_->reject(this, peer_, p.idx);
+            if (download_->peer_failed(peer_)) return give_up();
+            return pump();
+        }
+        download_->peer_ok(peer_);
+
+        if (!download_->write_chunk(p.idx * CHUNK_SIZE + p.skip, buf.data(), got)) {
+            download_->requeue(this, p.idx, "error writing at offset " + std::to_string(p.idx * CHUNK_SIZE + p.skip));
+            return pump();
+        }
+
+        record_download_from(ip_, got);
+        download_->chunk_done(this, peer_, p.idx, tuner_);
+
+        log_line(LogLevel::Debug, "[Leecher] Chunk ", p.idx, " from ", ip_, ":", port_,
+            " (", got, "/", got + p.skip, p.skip ? ", resumed" : "", ")");
+
+        // Not reading while over the limit lets TCP flow control slow the
+        // sender down; requests already written stay queued on its side
+        auto wait = reserve_all({
+            { &rate_limits.download_bucket, rate_limits.global_download.load() },
+            { &download_->bucket, download_->rate_cap() },
+            { bucket_.get(), rate_limits.peer_download.load() } }, got);
+        if (wait.count() <= 0) return pump();
+        this->wait(wait);
+    }
+
+    // Stops reading and requesting for a while, then resumes with pump()
+    void wait(clock::duration delay)
+    {
+        throttled_ = true;
+        throttle_.expires_after(delay);
+        auto self = shared_from_this();
+        throttle_.async_wait([self, gen = generation_](const boost::system::error_code& ec) {
+            if (ec || gen != self->generation_) return;
+            self->throttled_ = false;
+            self->pump();
+        });
+    }
+
+    // Closes the connection if the current step takes longer than `timeout`
+    void arm(clock::duration timeout)
+    {
+        timed_out_ = false;
+        deadline_.expires_after(timeout);
+        auto self = shared_from_this();
+        deadline_.async_wait([self, gen = generation_](const boost::system::error_code& ec) {
+            if (ec || gen != self->generation_) return;
+            self->timed_out_ = true;
+            boost::system::error_code ignored;
+            self->sock_.close(ignored);
+        });
+    }
+
+    void disarm() { deadline_.cancel(); }
+
+    // Everything still queued on this connection is lost with it
+    void fail(const std::string& reason)
+    {
+        ++generation_;
+        // A dead tracker entry or a breaker trial that doesn't connect isn't
+        // a reason to shed connections to the peers that work
+        if (established_) ++download_->failures;
+        disarm();
+        throttle_.cancel();
+        boost::system::error_code ignored;
+        sock_.close(ignored);
+
+        requeue_inflight(reason);
+        pending_out_.clear();
+
+        // Without the file size there is nothing to fetch yet; another
+        // peer is asked instead
+        if (download_->total_chunks == 0) {
+            if (!download_->sized) {
+                download_->peer_failed(peer_);
+                download_->race();
             }
+            return finish();
+        }
+        if (download_->peer_failed(peer_)) return give_up();
+        reconnect_after(download_->health_of(peer_).backoff());
+    }
+
+    void reconnect_after(clock::duration delay)
+    {
+        throttle_.expires_after(delay);
+        auto self = shared_from_this();
+        throttle_.async_wait([self, gen = generation_](const boost::system::error_code& ec) {
+            if (ec || gen != self->generation_) return;
+            self->connect();
+        });
+    }
+
+    // The peer's breaker tripped
+    void give_up()
+    {
+        const PeerHealth& h = download_->health_of(peer_);
+        if (h.state(clock::now()) == PeerHealth::State::Removed) {
+            log_line(LogLevel::Warn, "[Leecher] Removing ", peer_, " from ", download_->save_fn,
+                " after ", h.failures(), " failures");
+        }
+        else {
+            log_line(LogLevel::Warn, "[Leecher] Circuit open for ", peer_, " after ",
+                h.failures(), " failures; its chunks go to other peers");
+        }
+        finish();
+    }
+
+    void finish()
+    {
+        if (finished_) return;
+        auto self = shared_from_this();  // parked may hold the last reference
+        finished_ = true;
+        ++generation_;
+        disarm();
+        throttle_.cancel();
+        boost::system::error_code ignored;
+        sock_.close(ignored);
+        requeue_inflight("connection closed");
+        buf_ = PooledBuffer();
+        auto& live = download_->live;
+        live.erase(std::remove(live.begin(), live.end(), this), live.end());
+        --open_connections;
+
+        // The quorum has one answer fewer to wait for
+        auto& parked = download_->parked;
+        parked.erase(std::remove(parked.begin(), parked.end(), self), parked.end());
+        if (fetching_manifest_) {
+            fetching_manifest_ = false;
+            --download_->manifest_pending;
+            download_->settle_manifest(false);
         }
+
+        log_line(LogLevel::Info, "[Leecher] Pipeline to ", ip_, ":", port_,
+            " ended at depth ", tuner_.depth(),
+            " (rtt ", tuner_.rtt() * 1000.0, " ms, ",
+            tuner_.rate() / (1024.0 * 1024.0), " MB/s)");
+        download_->peer_left(chunks_);
+        download_->peer_ended(peer_);
+        download_->session_ended();
     }
-    catch (const std::exception& e) {
-        std::lock_guard lk(cout_mutex);
-        std::cerr << "[Leecher] File verification error: " << e.what() << "\n";
+
+    void requeue_inflight(const std::string& reason)
+    {
+        for (const auto& p : inflight_) {
+            if (p.idx != HAVE_POLL) download_->requeue(this, p.idx, reason);
+        }
+        inflight_.clear();
+        have_pending_ = false;
     }
 
-    std::lock_guard lk(cout_mutex);
-    std::cout << "[Leecher] All chunks done. Saved as " << save_fn << "\n";
+    std::shared_ptr<Download> download_;
+    std::string peer_;
+    std::string ip_;
+    unsigned short port_ = 0;
+
+    tcp::socket sock_;
+    boost::asio::steady_timer deadline_;
+    boost::asio::steady_timer throttle_;
+    std::string line_;         // handshake, text FILESIZE and error replies
+    char header_[FRAME_HEADER_SIZE];
+    std::string write_buf_;    // bytes being written
+    std::string pending_out_;  // requests queued behind the current write
+
+    PipelineTuner tuner_;
+    std::deque<Pending> inflight_;
+    PooledBuffer buf_;  // body of the response being read
+    clock::time_point first_byte_;
+    clock::time_point last_done_;
+    std::shared_ptr<TokenBucket> bucket_;  // per-peer level of the download rate limit
+    size_t size_ = 0;  // file size the peer gave
+    PeerChunks chunks_;
+    clock::time_point last_have_;
+
+    unsigned generation_ = 0;
+    bool framed_ = false;
+    bool text_only_ = false;
+    bool reading_ = false;
+    bool writing_ = false;
+    bool throttled_ = false;
+    bool have_pending_ = false;
+    bool timed_out_ = false;
+    bool established_ = false;  // connected; a failure now says something about throughput
+    bool held_ = false;    // the peer announced the front reply will be late
+    bool choked_ = false;  // ...because we are choked
+    bool finished_ = false;
+    bool retiring_ = false;
+    bool fetching_manifest_ = false;
+};
+
+void Download::start()
+{
+    // DEBUG: show where we're writing
+    log_line(LogLevel::Debug, "[Leecher] Writing to ", std::filesystem::current_path() / "downloads" / save_fn);
+
+    // A few peers race to give the file size; the rest start once the
+    // manifest is settled
+    auto self = shared_from_this();
+    boost::asio::post(strand, [self]() { self->race(); });
+}
+
+void Download::race()
+{
+    if (sized || stopping) return;
+    for (size_t racing = live.size(); racing < RACE_PEERS && next_racer < peers.size(); ++racing) add_voter();
+}
+
+void Download::add_voter()
+{
+    std::make_shared<PeerSession>(shared_from_this(), peers[next_racer++])->start_voter();
+}
+
+bool Download::set_size(size_t size)
+{
+    sized = true;
+    filesize = size;
+    total_chunks = (filesize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+    // Create download directory if it doesn't exist
+    std::filesystem::create_directory("downloads");
+
+    // An interrupted download of the same file carries on where it stopped;
+    // anything else starts over
+    SavedDownload saved;
+    bool resuming = load_download_state(save_fn, saved) &&
+        saved.request_fn == request_fn && saved.filesize == filesize;
+    if (!resuming) {
+        saved = SavedDownload{ request_fn, save_fn, filesize, peers, std::vector<bool>(total_chunks, false) };
+    }
+    // Reserve the whole file up front; chunks are written into place
+    if (!out.open(path(), filesize, resuming)) {
+        log_line(LogLevel::Error, "[Leecher] Failed to open output file: downloads/", save_fn);
+        total_chunks = 0;
+        return false;
+    }
+    saved.peers = peers;
+    state.create(saved);
+
+    // Seed the chunks we have while downloading the rest. The server
+    // resolves the request name under downloads/, so that only works when
+    // the file keeps its name.
+    local_chunks.begin(path(), filesize);
+    if (save_fn == request_fn) {
+        std::thread([request_fn = request_fn, tracker_ip = tracker_ip, tracker_port = tracker_port, my_port = my_port]() {
+            register_with_retry(tracker_ip, tracker_port, request_fn, get_local_ip(), my_port);
+            }).detach();
+    }
+
+    static thread_local std::mt19937 rng{ std::random_device{}() };  // one per engine thread
+    first_chunk = std::uniform_int_distribution<size_t>(0, total_chunks - 1)(rng);
+    availability.assign(total_chunks, 0);
+    queued.assign(total_chunks, false);
+    done.assign(total_chunks, false);
+    for (size_t i = 0; i < total_chunks; ++i) {
+        if (!saved.have[i]) {
+            enqueue(i);
+            continue;
+        }
+        done[i] = true;
+        ++completed;
+        local_chunks.add(path(), i);
+    }
+    last_progress = clock::now();
+    if (resuming) {
+        log_line(LogLevel::Info, "[Leecher] Resuming ", save_fn, ": ", completed, " of ",
+            total_chunks, " chunks already downloaded");
+    }
+
+    // Initialize progress tracking
+    {
+        std::lock_guard lk(downloads_mutex);
+        auto& dp = active_downloads[save_fn];
+        dp.filename = request_fn;
+        dp.total_chunks = total_chunks;
+        dp.completed_chunks = completed;
+        dp.finished = false;
+        dp.interrupted = false;
+    }
+
+    return true;
+}
+
+void Download::manifest_answer(PeerSession* session, const std::string& peer, size_t size, ManifestPtr m)
+{
+    auto s = session->shared_from_this();
+    if (sized && size != filesize) {
+        log_line(LogLevel::Warn, "[Leecher] ", peer, " reports ", size, " bytes for ", request_fn,
+            ", not ", filesize, "; leaving it out");
+        remove_peer(peer);
+        boost::asio::post(strand, [s]() { s->unpark(); });
+        return;
+    }
+    if (peers_opened) {
+        if (m && manifest && m->root != manifest->root) {
+            log_line(LogLevel::Warn, "[Leecher] ", peer, " disagrees on the manifest of ", save_fn, "; excluding it");
+            remove_peer(peer);
+        }
+        boost::asio::post(strand, [s]() { s->unpark(); });
+        return;
+    }
+
+    auto vote = std::find_if(manifest_votes.begin(), manifest_votes.end(), [&](const ManifestVote& v) {
+        return v.size == size && (v.manifest && m ? v.manifest->root == m->root : v.manifest == m);
+    });
+    if (vote == manifest_votes.end()) manifest_votes.push_back({ size, std::move(m), { peer } });
+    else vote->peers.push_back(peer);
+    parked.push_back(std::move(s));
+    settle_manifest(false);
+}
+
+void Download::settle_manifest(bool grace_over)
+{
+    if (peers_opened || stopping) return;
+
+    auto leading = [&]() {
+        auto best = manifest_votes.end();
+        for (auto it = manifest_votes.begin(); it != manifest_votes.end(); ++it) {
+            if (it->manifest && (best == manifest_votes.end() || it->peers.size() > best->peers.size())) best = it;
+        }
+        return best;
+    };
+    size_t answers = 0;
+    for (const auto& v : manifest_votes) answers += v.peers.size();
+    auto best = leading();
+    bool agreed = best != manifest_votes.end() && best->peers.size() >= MANIFEST_QUORUM;
+    if (!agreed && !grace_over && manifest_pending > 0) {
+        if (answers > 0 && !manifest_grace) {
+            manifest_grace = true;
+            manifest_timer.expires_after(MANIFEST_GRACE);
+            manifest_timer.async_wait([self = shared_from_this()](const boost::system::error_code& ec) {
+                if (!ec) self->settle_manifest(true);
+            });
+        }
+        return;
+    }
+    manifest_timer.cancel();
+    if (answers == 0) return;  // race() goes on to the next peers
+
+    // Arrival order decides nothing: without a majority another peer is
+    // asked. When none is left, a split size ends the download and a split
+    // manifest isn't used; the chunks then go unchecked and nobody is
+    // excluded.
+    if (!sized) {
+        std::map<size_t, size_t> sizes;
+        for (const auto& v : manifest_votes) sizes[v.size] += v.peers.size();
+        auto size = std::max_element(sizes.begin(), sizes.end(),
+            [](const auto& a, const auto& b) { return a.second < b.second; });
+        if (size->second * 2 <= answers) {
+            if (next_racer < peers.size()) {
+                log_line(LogLevel::Info, "[Leecher] Peers disagree on the size of ", request_fn,
+                    "; asking ", peers[next_racer]);
+                return add_voter();
+            }
+            log_line(LogLevel::Warn, "[Leecher] Peers disagree on the size of ", request_fn,
+                " and none is left to ask; giving up on ", save_fn);
+            return stop();
+        }
+        if (!set_size(size->first)) return stop();
+
+        for (const auto& v : manifest_votes) {
+            if (v.size == filesize) continue;
+            for (const auto& peer : v.peers) {
+                log_line(LogLevel::Warn, "[Leecher] ", peer, " reports ", v.size, " bytes for ", request_fn,
+                    ", not ", filesize, "; leaving it out");
+                remove_peer(peer);
+            }
+        }
+        manifest_votes.erase(std::remove_if(manifest_votes.begin(), manifest_votes.end(),
+            [&](const ManifestVote& v) { return v.size != filesize; }), manifest_votes.end());
+        best = leading();
+    }
+
+    if (best == manifest_votes.end()) {
+        log_line(LogLevel::Warn, "[Leecher] No peer has a manifest for ", request_fn, "; chunks of ",
+            save_fn, " won't be verified");
+        return set_manifest(nullptr);
+    }
+
+    size_t manifests = 0;
+    for (const auto& v : manifest_votes) {
+        if (v.manifest) manifests += v.peers.size();
+    }
+    if (best->peers.size() * 2 <= manifests) {
+        if (next_racer < peers.size()) {
+            log_line(LogLevel::Info, "[Leecher] Peers disagree on the manifest of ", save_fn,
+                "; asking ", peers[next_racer]);
+            return add_voter();
+        }
+        log_line(LogLevel::Warn, "[Leecher] Peers disagree on the manifest of ", save_fn,
+            " and none is left to ask; its chunks won't be verified");
+        return set_manifest(nullptr);
+    }
+
+    log_line(LogLevel::Info, "[Leecher] Manifest of ", save_fn, " from ", best->peers.size(), " of ",
+        manifests, " peers (root ", to_hex(best->manifest->root.data(), best->manifest->root.size()), ")");
+    for (auto it = manifest_votes.begin(); it != manifest_votes.end(); ++it) {
+        if (it == best || !it->manifest) continue;
+        for (const auto& peer : it->peers) {
+            log_line(LogLevel::Warn, "[Leecher] ", peer, " disagrees on the manifest of ", save_fn, "; excluding it");
+            remove_peer(peer);
+        }
+    }
+    set_manifest(best->manifest);
+}
+
+void Download::set_manifest(ManifestPtr m)
+{
+    manifest = std::move(m);
+    local_chunks.set_manifest(path(), manifest);
+    open_peers();
+}
+
+void Download::open_peers()
+{
+    if (peers_opened) return;
+    peers_opened = true;
+    download_manager.poll(save_fn, weight);
+    running_weight += weight;
+
+    // The racers that lost keep their connections
+    for (auto& s : parked) boost::asio::post(strand, [s]() { s->unpark(); });
+    parked.clear();
+    conn_tuner.set_max(connection_limit());
+    while (live.size() < conn_tuner.target() && add_connection()) {}
+    last_tune = clock::now();
+    bytes_at_tune = bytes_done;
+    schedule_tune();
+}
+
+size_t Download::connection_limit() const
+{
+    size_t fair_share = leecher_max_connections * weight / std::max(running_weight.load(), 1u);
+    auto now = clock::now();
+    size_t usable_peers = std::count_if(peers.begin(), peers.end(),
+        [&](const std::string& peer) { return usable(peer, now); });
+    return std::max<size_t>(1, std::min({ MAX_DOWNLOAD_CONNECTIONS, fair_share,
+        usable_peers * MAX_PEER_CONNECTIONS }));
+}
+
+bool Download::add_connection()
+{
+    if (stopping || open_connections >= leecher_max_connections) return false;
+
+    std::map<std::string, size_t> open;
+    for (PeerSession* s : live) {
+        if (!s->retiring()) ++open[s->peer()];
+    }
+
+    // A peer on trial after its breaker opened gets one connection
+    auto now = clock::now();
+    const std::string* pick = nullptr;
+    double best = -1.0;
+    for (const auto& peer : peers) {
+        if (!usable(peer, now)) continue;
+        size_t n = open[peer];
+        if (n > 0 && health[peer].state(now) == PeerHealth::State::HalfOpen) continue;
+        if (n == 0) {
+            pick = &peer;
+            break;
+        }
+        if (n >= MAX_PEER_CONNECTIONS) continue;
+        auto stats = std::find_if(peer_stats.begin(), peer_stats.end(),
+            [&](const PeerProgress& p) { return p.peer == peer; });
+        double per_connection = stats != peer_stats.end() ? stats->rate / n : 0.0;
+        if (per_connection > best) {
+            best = per_connection;
+            pick = &peer;
+        }
+    }
+    if (!pick) return false;
+
+    std::make_shared<PeerSession>(shared_from_this(), *pick)->start();
+    return true;
+}
+
+void Download::retire_connection()
+{
+    // From the peer with the most connections, its slowest one
+    std::map<std::string, size_t> open;
+    for (PeerSession* s : live) {
+        if (!s->retiring()) ++open[s->peer()];
+    }
+    PeerSession* victim = nullptr;
+    for (PeerSession* s : live) {
+        if (s->retiring()) continue;
+        if (!victim || open[s->peer()] > open[victim->peer()] ||
+            (open[s->peer()] == open[victim->peer()] && s->rate() < victim->rate()))
+            victim = s;
+    }
+    if (victim) victim->retire();
+}
+
+void Download::stop()
+{
+    stopping = true;
+    std::vector<std::shared_ptr<PeerSession>> sessions_now;
+    for (PeerSession* s : live) sessions_now.push_back(s->shared_from_this());
+    for (auto& s : sessions_now) s->stop();
+}
+
+uint64_t Download::rate_cap() const
+{
+    uint64_t cap = rate_limits.per_download;
+    uint64_t global = rate_limits.global_download;
+    if (global) {
+        uint64_t share = global * weight / std::max(running_weight.load(), 1u);
+        cap = cap ? std::min(cap, share) : share;
+    }
+    return cap;
+}
+
+void Download::schedule_tune()
+{
+    tune_timer.expires_after(TUNE_INTERVAL);
+    tune_timer.async_wait([self = shared_from_this()](const boost::system::error_code& ec) {
+        if (!ec) self->tune();
+    });
+}
+
+void Download::tune()
+{
+    if (ended || completed == total_chunks) return;
+
+    unsigned w = weight;
+    if (!download_manager.poll(save_fn, w)) {
+        stop();
+        if (live.empty()) end();
+        return;
+    }
+    if (w != weight) {
+        running_weight += w;
+        running_weight -= weight;
+        weight = w;
+    }
+
+    // Every connection is gone; retry once a breaker lets a peer back in
+    if (live.empty()) {
+        add_connection();
+        if (live.empty() && !recovering()) return end();
+        return schedule_tune();
+    }
+
+    auto now = clock::now();
+    double secs = std::chrono::duration<double>(now - last_tune).count();
+    double rate = (bytes_done - bytes_at_tune) / std::max(secs, 1e-3);
+    last_tune = now;
+    bytes_at_tune = bytes_done;
+    size_t failed = failures;
+    failures = 0;
+
+    // Once everything is handed out, more connections can't help
+    if (!work.empty()) {
+        size_t before = conn_tuner.target();
+        conn_tuner.set_max(connection_limit());
+        conn_tuner.on_interval(rate, failed);
+        if (conn_tuner.target() != before) {
+            log_line(LogLevel::Info, "[Leecher] ", save_fn, ": ", before, " -> ", conn_tuner.target(),
+                " connections (", rate / (1024.0 * 1024.0), " MB/s, ", failed, " failures)");
+        }
+    }
+
+    size_t active = std::count_if(live.begin(), live.end(), [](PeerSession* s) { return !s->retiring(); });
+    for (; active < conn_tuner.target() && add_connection(); ++active) {}
+    for (; active > conn_tuner.target(); --active) retire_connection();
+
+    schedule_tune();
+}
+
+Download::Check Download::verify(size_t idx, size_t skip, const char* data, size_t len) const
+{
+    if (!manifest) return Check::Good;
+
+    // Other copies may still resume from the saved state, so it is copied
+    Sha256 h;
+    if (skip > 0) {
+        auto it = partial_hash.find(idx);
+        if (it == partial_hash.end() || it->second.length() != skip) return Check::Stale;
+        h = it->second;
+    }
+    h.update(data, len);
+    Sha256::Digest d = h.finish();
+    return std::memcmp(d.data(), manifest->chunk_digest(idx), d.size()) == 0 ? Check::Good : Check::Bad;
+}
+
+void Download::reject(PeerSession* owner, const std::string& peer, size_t idx)
+{
+    // Whatever was saved of it may be the bad part
+    resume_at.erase(idx);
+    partial_hash.erase(idx);
+    retries[idx].by_peer[peer] = BAD_SOURCE;
+    requeue(owner, idx, "hash mismatch from " + peer);
+}
+
+void Download::peer_ok(const std::string& peer)
+{
+    auto before = health[peer].state(clock::now());
+    health[peer].on_success();
+    if (before != PeerHealth::State::Closed) {
+        log_line(LogLevel::Info, "[Leecher] ", peer, " is back for ", save_fn);
+        health_changed(peer);
+    }
+}
+
+bool Download::peer_failed(const std::string& peer)
+{
+    bool tripped = health[peer].on_failure(clock::now());
+    if (tripped) {
+        for (PeerSession* s : live) {
+            if (s->peer() != peer) continue;
+            boost::asio::post(strand, [session = s->shared_from_this()]() { session->stop(); });
+        }
+    }
+    health_changed(peer);
+    return tripped;
+}
+
+void Download::remove_peer(const std::string& peer)
+{
+    health[peer].remove();
+    health_changed(peer);
+}
+
+bool Download::usable(const std::string& peer, clock::time_point now) const
+{
+    auto it = health.find(peer);
+    if (it == health.end()) return true;
+    auto state = it->second.state(now);
+    return state == PeerHealth::State::Closed || state == PeerHealth::State::HalfOpen;
+}
+
+bool Download::recovering() const
+{
+    auto now = clock::now();
+    return std::any_of(health.begin(), health.end(), [&](const auto& h) {
+        auto state = h.second.state(now);
+        return state == PeerHealth::State::Open || state == PeerHealth::State::HalfOpen;
+    });
+}
+
+void Download::health_changed(const std::string& peer)
+{
+    const PeerHealth& h = health[peer];
+    std::string label;
+    switch (h.state(clock::now())) {
+    case PeerHealth::State::Closed: label = std::to_string(static_cast<int>(h.score() * 100.0 + 0.5)) + "%"; break;
+    case PeerHealth::State::Open: label = "circuit open"; break;
+    case PeerHealth::State::HalfOpen: label = "on trial"; break;
+    case PeerHealth::State::Removed: label = "removed"; break;
+    }
+    for (auto& p : peer_stats) {
+        if (p.peer == peer) p.health = label;
+    }
+}
+
+Pick Download::next_chunk(PeerSession* owner, const std::string& peer, size_t inflight,
+    const PeerChunks& chunks, size_t& idx, size_t& skip)
+{
+    // Sessions stay around while chunks are in flight in case one fails
+    if (work.empty() && in_flight.empty()) return Pick::Empty;
+    if (work.empty() && !leecher_endgame) return Pick::Deferred;
+
+    // Unmeasured peers always get work so they can be measured
+    auto me = std::find_if(peer_stats.begin(), peer_stats.end(),
+        [&](const PeerProgress& p) { return p.peer == peer; });
+    if (me != peer_stats.end() && me->rate > 0.0) {
+        double best = 0.0, others = 0.0;
+        for (const auto& p : peer_stats) {
+            if (!p.active) continue;
+            best = std::max(best, p.rate);
+            if (p.peer != peer) others += p.rate;
+        }
+
+        if (me->rate < best * SLOW_PEER_FRACTION) {
+            if (inflight > 0) return Pick::Deferred;
+            double own_rate = owner->rate() > 0.0 ? owner->rate() : me->rate;
+            double finish_one = me->latency + CHUNK_SIZE / own_rate;
+            double drain_rest = work.size() * static_cast<double>(CHUNK_SIZE) / others;
+            if (finish_one > drain_rest) return Pick::Deferred;
+        }
+    }
+
+    if (work.empty()) {
+        // Endgame: the chunk with the fewest copies in flight that this
+        // peer holds and isn't already fetching
+        auto best = in_flight.end();
+        for (auto it = in_flight.begin(); it != in_flight.end(); ++it) {
+            const auto& owners = it->second;
+            if (owners.size() >= ENDGAME_COPIES) continue;
+            if (std::find(owners.begin(), owners.end(), owner) != owners.end()) continue;
+            if (!can_fetch(peer, chunks, it->first)) continue;
+            if (best == in_flight.end() || owners.size() < best->second.size()) best = it;
+        }
+        if (best == in_flight.end()) return Pick::Deferred;
+        idx = best->first;
+        best->second.push_back(owner);
+        auto r = resume_at.find(idx);
+        skip = r != resume_at.end() ? r->second : 0;
+        return Pick::Assigned;
+    }
+
+    auto it = work.begin();
+    if (!chunks.all || !retries.empty()) {
+        it = std::find_if(work.begin(), work.end(), [&](const auto& w) {
+            return can_fetch(peer, chunks, chunk_at(w.second));
+        });
+        if (it == work.end()) return Pick::Deferred;
+    }
+
+    idx = chunk_at(it->second);
+    work.erase(it);
+    queued[idx] = false;
+    in_flight[idx].push_back(owner);
+    if (work.empty() && tail_start == clock::time_point()) tail_start = clock::now();
+    auto r = resume_at.find(idx);
+    skip = r != resume_at.end() ? r->second : 0;
+    return Pick::Assigned;
+}
+
+bool Download::can_fetch(const std::string& peer, const PeerChunks& chunks, size_t idx) const
+{
+    if (!chunks.all && (idx >= chunks.have.size() || !chunks.have[idx])) return false;
+    auto r = retries.find(idx);
+    if (r == retries.end()) return true;
+    if (clock::now() < r->second.not_before) return false;
+    auto tries = r->second.by_peer.find(peer);
+    return tries == r->second.by_peer.end() || tries->second < CHUNK_PEER_RETRIES;
+}
+
+void Download::enqueue(size_t idx)
+{
+    if (queued[idx]) return;
+    queued[idx] = true;
+    work.emplace(availability[idx], rank(idx));
+}
+
+void Download::add_availability(size_t idx, int delta)
+{
+    if (queued[idx]) work.erase({ availability[idx], rank(idx) });
+    availability[idx] += delta;
+    if (queued[idx]) work.emplace(availability[idx], rank(idx));
+}
+
+void Download::peer_has(PeerChunks& peer, size_t idx)
+{
+    if (peer.all || idx >= total_chunks) return;
+    if (peer.have.empty()) peer.have.assign(total_chunks, false);
+    if (peer.have[idx]) return;
+    peer.have[idx] = true;
+    add_availability(idx, 1);
+}
+
+void Download::peer_has_all(PeerChunks& peer)
+{
+    if (peer.all) return;
+    for (size_t i = 0; i < peer.have.size(); ++i) {
+        if (peer.have[i]) add_availability(i, -1);
+    }
+    peer.have.clear();
+    peer.all = true;
+}
+
+void Download::peer_left(PeerChunks& peer)
+{
+    for (size_t i = 0; i < peer.have.size(); ++i) {
+        if (peer.have[i]) add_availability(i, -1);
+    }
+    peer = PeerChunks();
+}
+
+void Download::chunk_done(PeerSession* owner, const std::string& peer, size_t idx, const PipelineTuner& tuner)
+{
+    done[idx] = true;
+    ++completed;
+    retries.erase(idx);
+    resume_at.erase(idx);
+    partial_hash.erase(idx);
+    last_progress = clock::now();
+    local_chunks.add(path(), idx);
+    unsynced.push_back(idx);
+    persist(false);
+
+    // Losing endgame copies are dropped by on_chunk when they arrive, which
+    // costs less than a reconnect and keeps their pipelines going. With the
+    // last chunk in, every other connection closes, including any still
+    // waiting on a slow peer for the file size.
+    in_flight.erase(idx);
+    if (completed == total_chunks) {
+        for (PeerSession* other : live) {
+            if (other != owner) boost::asio::post(strand, [session = other->shared_from_this()]() { session->stop(); });
+        }
+    }
+
+    if (completed == total_chunks && tail_start != clock::time_point()) {
+        double ms = std::chrono::duration<double, std::milli>(last_progress - tail_start).count();
+        record_tail(leecher_endgame, ms);
+        log_line(LogLevel::Info, "[Leecher] Tail: last chunk handed out ", ms, " ms before completion (endgame ",
+            leecher_endgame ? "on" : "off", ")");
+    }
+
+    bytes_done += std::min(CHUNK_SIZE, filesize - idx * CHUNK_SIZE);
+
+    // A peer's rate is the sum over its connections
+    for (auto& p : peer_stats) {
+        if (p.peer != peer) continue;
+        p.rate = 0.0;
+        for (PeerSession* s : live) {
+            if (s->peer() == peer) p.rate += s->rate();
+        }
+        p.latency = tuner.latency();
+        ++p.chunks;
+    }
+
+    // Update progress
+    std::lock_guard lk(downloads_mutex);
+    auto& dp = active_downloads[save_fn];
+    if (++dp.completed_chunks == dp.total_chunks)
+        dp.finished = true;
+    dp.peers = peer_stats;
+}
+
+void Download::peer_ended(const std::string& peer)
+{
+    for (auto& p : peer_stats) {
+        if (p.peer == peer && --p.connections == 0) p.active = false;
+    }
+
+    std::lock_guard lk(downloads_mutex);
+    auto it = active_downloads.find(save_fn);
+    if (it != active_downloads.end()) it->second.peers = peer_stats;
+}
+
+bool Download::drop_owner(PeerSession* owner, size_t idx)
+{
+    auto it = in_flight.find(idx);
+    if (it == in_flight.end()) return true;
+    auto& owners = it->second;
+    owners.erase(std::remove(owners.begin(), owners.end(), owner), owners.end());
+    if (!owners.empty()) return false;
+    in_flight.erase(it);
+    return true;
+}
+
+void Download::release(PeerSession* owner, size_t idx)
+{
+    if (drop_owner(owner, idx) && !done[idx]) enqueue(idx);
+}
+
+void Download::requeue(PeerSession* owner, size_t idx, const std::string& reason)
+{
+    if (done[idx]) {
+        drop_owner(owner, idx);
+        return;
+    }
+    ChunkRetry& r = retries[idx];
+    unsigned& tries = r.by_peer[owner->peer()];
+    if (tries != BAD_SOURCE) ++tries;
+    if (!drop_owner(owner, idx)) return;
+
+    auto delay = std::min<clock::duration>(CHUNK_BACKOFF_BASE * (1u << std::min(r.attempts, 6u)), CHUNK_BACKOFF_MAX);
+    ++r.attempts;
+    r.not_before = clock::now() + delay;
+    enqueue(idx);
+    log_line(LogLevel::Warn, "[Leecher] Chunk ", idx, " failed: ", reason, ". Retrying in ",
+        std::chrono::duration_cast<std::chrono::milliseconds>(delay).count(), " ms");
+
+    // Once every usable peer has used up its tries, they all get another
+    // round; only peers that sent bad data stay ruled out
+    auto now = clock::now();
+    bool any_left = std::any_of(peers.begin(), peers.end(), [&](const std::string& peer) {
+        auto t = r.by_peer.find(peer);
+        return usable(peer, now) && (t == r.by_peer.end() || t->second < CHUNK_PEER_RETRIES);
+    });
+    if (!any_left) {
+        for (auto& [peer, n] : r.by_peer) {
+            if (n != BAD_SOURCE) n = 0;
+        }
+    }
+}
+
+void Download::save_partial(size_t idx, size_t skip, const char* data, size_t len)
+{
+    // A finished chunk is never overwritten, and a stale copy's bytes don't
+    // line up with the saved hash state
+    if (done[idx]) return;
+    auto r = resume_at.find(idx);
+    if (skip != (r != resume_at.end() ? r->second : 0)) return;
+
+    if (!write_chunk(idx * CHUNK_SIZE + skip, data, len)) return;
+    resume_at[idx] = skip + len;
+
+    // Keep hashing where the retry will pick up
+    if (manifest) {
+        Sha256& h = partial_hash[idx];
+        if (skip == 0) h = Sha256();
+        h.update(data, len);
+    }
+}
+
+bool Download::write_chunk(uint64_t offset, const char* data, size_t len)
+{
+    return out.write_at(data, len, offset);
+}
+
+void Download::persist(bool force)
+{
+    if (unsynced.empty()) return;
+    bool durable = leecher_sync_policy != SyncPolicy::None;
+    if (leecher_sync_policy == SyncPolicy::Periodic && !force &&
+        unsynced.size() * CHUNK_SIZE < leecher_sync_bytes) return;
+
+    if (durable) out.sync();
+    for (size_t idx : unsynced) state.mark(idx);
+    state.flush(durable);
+    unsynced.clear();
+}
+
+void Download::session_ended()
+{
+    if (--sessions > 0) return;
+    if (peers_opened && !stopping && completed < total_chunks && recovering()) {
+        log_line(LogLevel::Info, "[Leecher] ", save_fn, ": no connections left; waiting for a peer to recover");
+        return;
+    }
+    end();
+}
+
+void Download::end()
+{
+    if (ended) return;
+    ended = true;
+    tune_timer.cancel();
+    manifest_timer.cancel();
+    parked.clear();
+    if (peers_opened) running_weight -= weight;
+
+    if (total_chunks == 0) {
+        if (!sized) log_line(LogLevel::Error, "[Leecher] No size settled for ", request_fn);
+        {
+            std::lock_guard lk(downloads_mutex);
+            active_downloads.erase(save_fn);
+        }
+        download_manager.stopped(save_fn, false);
+        return;
+    }
+
+    log_line(LogLevel::Info, "[Leecher] ", total_chunks, " chunks over ",
+        connections_opened, " peer connections");
+
+    // Make what arrived durable, then close the output file
+    persist(true);
+    out = OutputFile();
+
+    // A complete file is served like any other; an incomplete one keeps
+    // refusing the chunks it is missing and can be resumed later
+    if (completed == total_chunks) {
+        if (manifest) save_manifest(path(), *manifest);
+        local_chunks.end(path());
+        state.remove();
+    }
+    else {
+        if (stopping) {
+            log_line(LogLevel::Info, "[Leecher] ", save_fn, " paused at ", completed, " of ",
+                total_chunks, " chunks");
+        }
+        else {
+            log_line(LogLevel::Warn, "[Leecher] ", save_fn, " interrupted at ", completed, " of ",
+                total_chunks, " chunks; it can be resumed");
+        }
+        {
+            std::lock_guard lk(downloads_mutex);
+            active_downloads[save_fn].interrupted = true;
+        }
+        download_manager.stopped(save_fn, false);
+        return;
+    }
+
+    // Every chunk was checked against the manifest as it arrived, so the
+    // file needs no second pass before it is shared
+    log_line(LogLevel::Info, "[Leecher] All chunks done. Saved as ", save_fn);
+    download_manager.stopped(save_fn, true);
+    std::thread(register_download, request_fn, my_port, tracker_ip, tracker_port).detach();
+}
+
+void register_download(const std::string& request_fn,
+    unsigned short my_port, const std::string& tracker_ip, unsigned short tracker_port)
+{
+    // Register the downloaded file with the tracker so it can be shared
+    bool registered = register_with_retry(
+        tracker_ip, tracker_port,
+        request_fn,  // Use original filename for registration
+        get_local_ip(), my_port);
+
+    if (registered) {
+        log_line(LogLevel::Info, "[AutoSeeder] Successfully registered downloaded file: ",
+            request_fn, " for seeding");
+    }
+    else {
+        log_line(LogLevel::Error, "[AutoSeeder] Failed to register file: ", request_fn);
+    }
+}
+
+} // namespace
+
+void start_download(const std::vector<std::string>& all_peers,
+    const std::string& request_fn,
+    const std::string& save_fn,
+    unsigned short my_port,
+    const std::string& tracker_ip,
+    unsigned short tracker_port)
+{
+    // Filter out self from peers
+    auto peers = all_peers;
+    std::string self_ep = get_local_ip() + ":" + std::to_string(my_port);
+    peers.erase(std::remove(peers.begin(), peers.end(), self_ep), peers.end());
+    if (peers.empty()) peers.push_back(self_ep);
+
+    std::make_shared<Download>(std::move(peers), request_fn, save_fn,
+        my_port, tracker_ip, tracker_port)->start();
+}
+
+bool resume_download(const std::string& save_fn,
+    unsigned short my_port,
+    const std::string& tracker_ip,
+    unsigned short tracker_port)
+{
+    SavedDownload saved;
+    if (!load_download_state(save_fn, saved)) return false;
+
+    // Already running (or being resumed by someone else)
+    {
+        std::lock_guard lk(downloads_mutex);
+        auto it = active_downloads.find(save_fn);
+        if (it != active_downloads.end() && !it->second.finished && !it->second.interrupted) return false;
+        if (it != active_downloads.end()) it->second.interrupted = false;
+    }
+
+    auto peers = get_peers_from_tracker(tracker_ip, tracker_port, saved.request_fn);
+    if (peers.empty()) peers = saved.peers;
+    if (peers.empty()) {
+        log_line(LogLevel::Warn, "[Leecher] No peers to resume ", save_fn, " from");
+        std::lock_guard lk(downloads_mutex);
+        active_downloads[save_fn].interrupted = true;
+        return false;
+    }
+
+    start_download(peers, saved.request_fn, save_fn, my_port, tracker_ip, tracker_port);
+    return true;
+}
+
+void resume_downloads(unsigned short my_port,
+    const std::string& tracker_ip,
+    unsigned short tracker_port)
+{
+    for (const auto& saved : saved_downloads()) {
+        // Until the download restarts, serve only the chunks already on disk
+        std::string path = (std::filesystem::path("downloads") / saved.save_fn).string();
+        local_chunks.begin(path, saved.filesize);
+        for (size_t i = 0; i < saved.have.size(); ++i) {
+            if (saved.have[i]) local_chunks.add(path, i);
+        }
+        {
+            std::lock_guard lk(downloads_mutex);
+            auto& dp = active_downloads[saved.save_fn];
+            dp.filename = saved.request_fn;
+            dp.total_chunks = saved.have.size();
+            dp.completed_chunks = saved.chunks_done();
+            dp.finished = false;
+            dp.interrupted = true;
+        }
+
+        log_line(LogLevel::Info, "[Leecher] Found interrupted download ", saved.save_fn, " (",
+            saved.chunks_done(), " of ", saved.have.size(), " chunks)");
+        download_manager.add_saved(saved.save_fn, my_port, tracker_ip, tracker_port);
+    }
+}
+
+TailStats tail_stats(bool endgame)
+{
+    std::vector<double> samples;
+    {
+        std::lock_guard lk(tail_mutex);
+        samples = tail_samples[endgame];
+    }
+    TailStats stats;
+    stats.count = samples.size();
+    if (samples.empty()) return stats;
+    std::sort(samples.begin(), samples.end());
+    auto at = [&](double q) { return samples[std::min(samples.size() - 1, static_cast<size_t>(q * samples.size()))]; };
+    stats.p50_ms = at(0.50);
+    stats.p99_ms = at(0.99);
+    return stats;
 }
@@ -4,10 +4,70 @@
 #include "utilities.h"
 #include "common.h"
 #include "tracker_client.h"
+#include "peer_health.h"
+#include "transfer_tuner.h"
+#include "protocol.h"
+#include "upload_slots.h"
+#include "rate_limiter.h"
 
-void run_leecher_parallel(const std::vector<std::string>& all_peers,
+// Requests kept outstanding per peer connection (0 = auto-tune from RTT and throughput)
+extern size_t leecher_pipeline_depth;
+
+// Connections per download (0 = grow and shrink with the measured throughput)
+extern size_t leecher_connections;
+
+// Most peer connections open at once over all downloads, split evenly
+// between the downloads running
+extern size_t leecher_max_connections;
+
+// Threads running the download event loop; read when the first download starts
+extern size_t leecher_threads;
+
+// When received data is forced to disk. A chunk is only recorded in the
+// download's resume state once its data has been synced, so a crash can
+// lose recent chunks but never leaves the state claiming bytes that aren't
+// on disk. Periodic (the default) syncs every leecher_sync_bytes, EveryChunk
+// after each chunk, and None leaves write-back to the OS: the state is then
+// updated per chunk and only survives the process crashing, not the machine.
+enum class SyncPolicy { None, Periodic, EveryChunk };
+extern SyncPolicy leecher_sync_policy;
+extern uint64_t leecher_sync_bytes;
+
+// Request the last in-flight chunks from several peers at once (endgame mode)
+extern bool leecher_endgame;
+
+// Completion tail: time from the last chunk being handed out to the
+// download finishing, over recent downloads with endgame on or off
+struct TailStats
+{
+    size_t count = 0;
+    double p50_ms = 0;
+    double p99_ms = 0;
+};
+TailStats tail_stats(bool endgame);
+
+// Downloads `request_fn` from the peers into downloads/`save_fn`. Returns
+// immediately: every download shares one event loop that drives all of its
+// peer connections asynchronously, so concurrency is bounded by sockets
+// rather than threads. Progress is reported through active_downloads.
+// Callers normally go through download_manager, which queues downloads and
+// starts them from here.
+void start_download(const std::vector<std::string>& all_peers,
     const std::string& request_fn,
     const std::string& save_fn,
     unsigned short my_port,
     const std::string& tracker_ip,
     unsigned short tracker_port);
+
+// Restarts the interrupted download saved as downloads/`save_fn`, from the
+// peers the tracker lists now or, failing that, the ones it last used.
+// Only the chunks missing from its state file are fetched.
+bool resume_download(const std::string& save_fn,
+    unsigned short my_port,
+    const std::string& tracker_ip,
+    unsigned short tracker_port);
+
+// Queues every interrupted download found under downloads/; called at startup
+void resume_downloads(unsigned short my_port,
+    const std::string& tracker_ip,
+    unsigned short tracker_port);
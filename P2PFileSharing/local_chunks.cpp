@@ -0,0 +1,86 @@
+#include "local_chunks.h"
+
+LocalChunks local_chunks;
+
+void LocalChunks::begin(const std::string& path, uint64_t filesize)
+{
+    std::lock_guard lk(mutex_);
+    Partial& p = files_[path];
+    p.filesize = filesize;
+    p.have.assign((filesize + CHUNK_SIZE - 1) / CHUNK_SIZE, false);
+    p.added.clear();
+    p.manifest = nullptr;
+}
+
+void LocalChunks::add(const std::string& path, size_t idx)
+{
+    std::lock_guard lk(mutex_);
+    auto it = files_.find(path);
+    if (it == files_.end() || idx >= it->second.have.size() || it->second.have[idx]) return;
+    it->second.have[idx] = true;
+    it->second.added.push_back(idx);
+}
+
+void LocalChunks::end(const std::string& path)
+{
+    std::lock_guard lk(mutex_);
+    files_.erase(path);
+}
+
+bool LocalChunks::has(const std::string& path, size_t idx) const
+{
+    std::lock_guard lk(mutex_);
+    auto it = files_.find(path);
+    return it == files_.end() || (idx < it->second.have.size() && it->second.have[idx]);
+}
+
+bool LocalChunks::partial_size(const std::string& path, uint64_t& filesize) const
+{
+    std::lock_guard lk(mutex_);
+    auto it = files_.find(path);
+    if (it == files_.end()) return false;
+    filesize = it->second.filesize;
+    return true;
+}
+
+bool LocalChunks::bitfield(const std::string& path, std::string& bits, uint64_t& version) const
+{
+    std::lock_guard lk(mutex_);
+    auto it = files_.find(path);
+    if (it == files_.end()) return false;
+
+    const auto& have = it->second.have;
+    bits.assign((have.size() + 7) / 8, '\0');
+    for (size_t i = 0; i < have.size(); ++i) {
+        if (have[i]) bits[i / 8] |= static_cast<char>(0x80 >> (i % 8));
+    }
+    version = it->second.added.size();
+    return true;
+}
+
+bool LocalChunks::added_since(const std::string& path, uint64_t version,
+    std::vector<uint64_t>& chunks, uint64_t& new_version) const
+{
+    std::lock_guard lk(mutex_);
+    auto it = files_.find(path);
+    if (it == files_.end()) return false;
+
+    const auto& added = it->second.added;
+    if (version < added.size()) chunks.assign(added.begin() + version, added.end());
+    new_version = added.size();
+    return true;
+}
+
+void LocalChunks::set_manifest(const std::string& path, ManifestPtr manifest)
+{
+    std::lock_guard lk(mutex_);
+    auto it = files_.find(path);
+    if (it != files_.end()) it->second.manifest = std::move(manifest);
+}
+
+ManifestPtr LocalChunks::manifest(const std::string& path) const
+{
+    std::lock_guard lk(mutex_);
+    auto it = files_.find(path);
+    return it == files_.end() ? nullptr : it->second.manifest;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "common.h"
+#include "manifest.h"
+#include <cstdint>
+#include <unordered_map>
+
+// Chunks we hold of the files still being downloaded, keyed by the path the
+// server resolves them to (downloads/<name>). The server answers BITFIELD
+// and HAVE requests from it and refuses chunks that haven't arrived yet, so
+// a leecher can seed what it has while it downloads the rest. Files that
+// aren't listed here are complete.
+class LocalChunks
+{
+public:
+    void begin(const std::string& path, uint64_t filesize);
+    void add(const std::string& path, size_t idx);
+    void end(const std::string& path);
+
+    // True unless `path` is a partial download missing chunk `idx`
+    bool has(const std::string& path, size_t idx) const;
+
+    // Size the file will have once complete; false if it isn't partial
+    bool partial_size(const std::string& path, uint64_t& filesize) const;
+
+    // Bitfield (chunk 0 is the high bit of the first byte) and its version,
+    // i.e. how many chunks have arrived; false if the file is complete
+    bool bitfield(const std::string& path, std::string& bits, uint64_t& version) const;
+
+    // Chunks that arrived after `version`; false if the file is complete
+    bool added_since(const std::string& path, uint64_t version,
+        std::vector<uint64_t>& chunks, uint64_t& new_version) const;
+
+    // Manifest the download is verified against, relayed to our own
+    // leechers; nullptr if it has none or the file is complete
+    void set_manifest(const std::string& path, ManifestPtr manifest);
+    ManifestPtr manifest(const std::string& path) const;
+
+private:
+    struct Partial
+    {
+        uint64_t filesize = 0;
+        std::vector<bool> have;
+        std::vector<uint64_t> added;  // in arrival order
+        ManifestPtr manifest;
+    };
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Partial> files_;
+};
+
+extern LocalChunks local_chunks;
@@ -0,0 +1,211 @@
+#include "logger.h"
+#include "common.h"
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+
+namespace logger {
+
+std::atomic<LogLevel> level{ LogLevel::Info };
+
+namespace {
+
+constexpr size_t RING_SIZE = 128;
+constexpr size_t MAX_LINE = 494;
+constexpr auto DRAIN_INTERVAL = std::chrono::milliseconds(5);
+
+struct Entry
+{
+    int64_t time_ns;
+    LogLevel level;
+    uint16_t len;
+    char text[MAX_LINE];
+};
+
+// Single-producer (owning thread) / single-consumer (drain thread) ring
+struct Ring
+{
+    Entry slots[RING_SIZE];
+    std::atomic<size_t> head{ 0 };  // next slot to write, owned by the producer
+    std::atomic<size_t> tail{ 0 };  // next slot to read, owned by the consumer
+    std::atomic<bool> closed{ false };
+};
+
+struct Line
+{
+    int64_t time_ns;
+    LogLevel level;
+    std::string text;
+};
+
+std::atomic<uint64_t> dropped_count{ 0 };
+
+// Never destroyed: detached threads may still log while statics are torn down
+struct Registry
+{
+    std::mutex mutex;
+    std::vector<std::shared_ptr<Ring>> rings;
+    std::mutex drain_mutex;
+    uint64_t reported_dropped = 0;
+};
+
+Registry& registry();
+void drain();
+
+void drain_loop()
+{
+    for (;;) {
+        std::this_thread::sleep_for(DRAIN_INTERVAL);
+        drain();
+    }
+}
+
+Registry& registry()
+{
+    static Registry* r = [] {
+        auto* reg = new Registry;
+        std::atexit(flush);
+        std::thread(drain_loop).detach();
+        return reg;
+    }();
+    return *r;
+}
+
+// Registers the thread's ring on first use and marks it closed at thread
+// exit; the drain thread frees it once it has been emptied
+struct LocalRing
+{
+    std::shared_ptr<Ring> ring = std::make_shared<Ring>();
+
+    LocalRing()
+    {
+        Registry& reg = registry();
+        std::lock_guard lk(reg.mutex);
+        reg.rings.push_back(ring);
+    }
+    ~LocalRing() { ring->closed.store(true, std::memory_order_release); }
+};
+
+void print(const Line& line)
+{
+    auto tp = std::chrono::system_clock::time_point(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(line.time_ns)));
+    std::time_t secs = std::chrono::system_clock::to_time_t(tp);
+    std::tm tm{};
+#ifdef _WIN32
+    localtime_s(&tm, &secs);
+#else
+    localtime_r(&secs, &tm);
+#endif
+    int ms = static_cast<int>((line.time_ns / 1000000) % 1000);
+
+    std::ostream& out = line.level >= LogLevel::Warn ? std::cerr : std::cout;
+    out << std::put_time(&tm, "%H:%M:%S") << '.' << std::setfill('0') << std::setw(3) << ms
+        << ' ' << std::left << std::setfill(' ') << std::setw(5) << level_name(line.level) << std::right
+        << ' ' << line.text << '\n';
+}
+
+void drain()
+{
+    Registry& reg = registry();
+    std::lock_guard drain_lk(reg.drain_mutex);
+
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+        std::lock_guard lk(reg.mutex);
+        rings = reg.rings;
+    }
+
+    std::vector<Line> batch;
+    std::vector<Ring*> finished;
+    for (auto& ring : rings) {
+        bool closed = ring->closed.load(std::memory_order_acquire);
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+        size_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail != head; ++tail) {
+            const Entry& e = ring->slots[tail % RING_SIZE];
+            batch.push_back({ e.time_ns, e.level, std::string(e.text, e.len) });
+        }
+        ring->tail.store(tail, std::memory_order_release);
+        if (closed) finished.push_back(ring.get());
+    }
+
+    if (!finished.empty()) {
+        std::lock_guard lk(reg.mutex);
+        reg.rings.erase(std::remove_if(reg.rings.begin(), reg.rings.end(), [&](const auto& r) {
+            return std::find(finished.begin(), finished.end(), r.get()) != finished.end();
+            }), reg.rings.end());
+    }
+
+    uint64_t lost = dropped_count.load(std::memory_order_relaxed);
+    if (batch.empty() && lost == reg.reported_dropped) return;
+
+    // Rings are each in order; merge them by timestamp
+    std::stable_sort(batch.begin(), batch.end(),
+        [](const Line& a, const Line& b) { return a.time_ns < b.time_ns; });
+
+    std::lock_guard out_lk(cout_mutex);
+    for (const auto& line : batch) print(line);
+    if (lost != reg.reported_dropped) {
+        std::cerr << "[Logger] " << lost - reg.reported_dropped << " messages dropped (buffer full)\n";
+        reg.reported_dropped = lost;
+    }
+    std::cout.flush();
+}
+
+} // namespace
+
+void write(LogLevel l, const std::string& text)
+{
+    thread_local LocalRing local;
+    Ring& ring = *local.ring;
+
+    size_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail.load(std::memory_order_acquire) == RING_SIZE) {
+        dropped_count.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    Entry& e = ring.slots[head % RING_SIZE];
+    e.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    e.level = l;
+    e.len = static_cast<uint16_t>(std::min(text.size(), MAX_LINE));
+    std::memcpy(e.text, text.data(), e.len);
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+bool parse_level(const std::string& name, LogLevel& out)
+{
+    for (LogLevel l : { LogLevel::Debug, LogLevel::Info, LogLevel::Warn, LogLevel::Error, LogLevel::Off }) {
+        if (name == level_name(l)) {
+            out = l;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* level_name(LogLevel l)
+{
+    switch (l) {
+    case LogLevel::Debug: return "debug";
+    case LogLevel::Info: return "info";
+    case LogLevel::Warn: return "warn";
+    case LogLevel::Error: return "error";
+    case LogLevel::Off: return "off";
+    }
+    return "unknown";
+}
+
+uint64_t dropped()
+{
+    return dropped_count.load(std::memory_order_relaxed);
+}
+
+void flush()
+{
+    drain();
+}
+
+} // namespace logger
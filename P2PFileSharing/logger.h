@@ -0,0 +1,51 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+enum class LogLevel : uint8_t { Debug, Info, Warn, Error, Off };
+
+// Asynchronous logger.
+//
+// Each thread appends to its own fixed-size ring buffer (single producer,
+// single consumer, no locks); a background thread drains all rings every
+// few milliseconds and writes the lines to stdout (Warn and Error go to
+// stderr) in timestamp order. A message below the current level costs one
+// relaxed atomic load, which is what keeps per-chunk messages (Debug, off by
+// default) cheap enough for the transfer hot path. When a ring is full the
+// message is dropped and counted rather than blocking the caller.
+namespace logger {
+
+extern std::atomic<LogLevel> level;
+
+inline bool enabled(LogLevel l)
+{
+    return l >= level.load(std::memory_order_relaxed);
+}
+
+// Appends a preformatted line to the calling thread's ring
+void write(LogLevel l, const std::string& text);
+
+// Parses "debug", "info", "warn", "error" or "off"; false if unknown
+bool parse_level(const std::string& name, LogLevel& out);
+const char* level_name(LogLevel l);
+
+// Messages dropped so far because a ring was full
+uint64_t dropped();
+
+// Writes out everything queued so far; called at exit automatically
+void flush();
+
+} // namespace logger
+
+// log_line(LogLevel::Info, "[Server] Sent chunk ", idx, " (", n, " bytes)");
+// Arguments are only formatted when the level is enabled.
+template <typename... Args>
+void log_line(LogLevel l, const Args&... args)
+{
+    if (!logger::enabled(l)) return;
+    std::ostringstream os;
+    (os << ... << args);
+    logger::write(l, os.str());
+}
@@ -0,0 +1,207 @@
+#include "manifest.h"
+#include "logger.h"
+#include <atomic>
+#include <cstring>
+
+ManifestStore manifests;
+
+namespace {
+
+constexpr const char* MANIFEST_EXTENSION = ".p2pmanifest";
+constexpr const char* MANIFEST_MAGIC = "P2PMANIFEST 1";
+
+Sha256::Digest root_of(const std::string& hashes)
+{
+    return Sha256::digest(hashes.data(), hashes.size());
+}
+
+} // namespace
+
+std::string Manifest::encode() const
+{
+    std::ostringstream header;
+    header << MANIFEST_MAGIC << "\n";
+    header << "size " << filesize << "\n";
+    header << "chunk " << chunk_size << "\n";
+    header << "root " << to_hex(root.data(), root.size()) << "\n";
+    header << "hashes\n";
+    return header.str() + hashes;
+}
+
+bool Manifest::decode(const std::string& data, Manifest& out)
+{
+    std::istringstream in(data);
+    std::string line;
+    if (!std::getline(in, line) || line != MANIFEST_MAGIC) return false;
+
+    Manifest m;
+    std::string root_hex;
+    while (std::getline(in, line) && line != "hashes") {
+        std::istringstream fields(line);
+        std::string key;
+        fields >> key;
+        if (key == "size") fields >> m.filesize;
+        else if (key == "chunk") fields >> m.chunk_size;
+        else if (key == "root") fields >> root_hex;
+    }
+    if (line != "hashes" || m.chunk_size == 0) return false;
+
+    auto pos = in.tellg();
+    if (pos < 0) return false;
+    size_t at = static_cast<size_t>(pos);
+    uint64_t chunks = (m.filesize + m.chunk_size - 1) / m.chunk_size;
+    if (data.size() - at != chunks * Sha256::DIGEST_SIZE) return false;
+    m.hashes = data.substr(at);
+
+    m.root = root_of(m.hashes);
+    if (to_hex(m.root.data(), m.root.size()) != root_hex) return false;
+    out = std::move(m);
+    return true;
+}
+
+std::string manifest_path(const std::string& file_path)
+{
+    return file_path + MANIFEST_EXTENSION;
+}
+
+bool is_manifest_file(const std::filesystem::path& path)
+{
+    return path.extension() == MANIFEST_EXTENSION;
+}
+
+ManifestPtr build_manifest(const FileHandle& file, uint64_t size, unsigned threads)
+{
+    auto m = std::make_shared<Manifest>();
+    m->filesize = size;
+    size_t chunks = static_cast<size_t>((size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    m->hashes.assign(chunks * Sha256::DIGEST_SIZE, '\0');
+
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = static_cast<unsigned>(std::min<size_t>(threads, std::max<size_t>(chunks, 1)));
+
+    // Workers take chunks in order from a shared counter; reads are
+    // positional, so they share the descriptor
+    std::atomic<size_t> next{ 0 };
+    std::atomic<bool> failed{ false };
+    auto work = [&]() {
+        std::vector<char> buf(CHUNK_SIZE);
+        for (size_t idx; !failed && (idx = next++) < chunks;) {
+            uint64_t offset = static_cast<uint64_t>(idx) * CHUNK_SIZE;
+            size_t len = static_cast<size_t>(std::min<uint64_t>(CHUNK_SIZE, size - offset));
+            if (file.read_at(buf.data(), len, offset) != static_cast<int64_t>(len)) {
+                failed = true;
+                return;
+            }
+            Sha256::Digest d = Sha256::digest(buf.data(), len);
+            std::memcpy(&m->hashes[idx * Sha256::DIGEST_SIZE], d.data(), d.size());
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; ++i) workers.emplace_back(work);
+    work();
+    for (auto& t : workers) t.join();
+    if (failed) return nullptr;
+
+    m->root = root_of(m->hashes);
+    return m;
+}
+
+bool save_manifest(const std::string& file_path, const Manifest& m)
+{
+    // Written aside and renamed, so a reader never sees half a manifest
+    std::string path = manifest_path(file_path);
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        std::string data = m.encode();
+        if (!out.write(data.data(), data.size())) return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    return !ec;
+}
+
+ManifestPtr load_manifest(const std::string& file_path, uint64_t size, fs::file_time_type mtime)
+{
+    std::string path = manifest_path(file_path);
+    std::error_code ec;
+    auto written = std::filesystem::last_write_time(path, ec);
+    if (ec || written < mtime) return nullptr;
+
+    std::ifstream in(path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    auto m = std::make_shared<Manifest>();
+    if (!Manifest::decode(data, *m) || m->filesize != size || m->chunk_size != CHUNK_SIZE) return nullptr;
+    return m;
+}
+
+ManifestPtr make_manifest(const std::string& file_path)
+{
+    FileHandle file(file_path);
+    if (!file.valid()) return nullptr;
+
+    auto start = std::chrono::steady_clock::now();
+    ManifestPtr m = build_manifest(file, file.size());
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!m) {
+        log_line(LogLevel::Error, "[Share] Could not hash ", file_path);
+        return nullptr;
+    }
+    log_line(LogLevel::Info, "[Share] Hashed ", file_path, " (", m->chunks(), " chunks) in ", secs,
+        " s; root ", to_hex(m->root.data(), m->root.size()));
+
+    if (!save_manifest(file_path, *m)) {
+        log_line(LogLevel::Warn, "[Share] Could not write ", manifest_path(file_path));
+    }
+    return m;
+}
+
+void ManifestStore::get(const std::shared_ptr<const CachedFile>& file, Handler handler)
+{
+    ManifestPtr ready;
+    {
+        std::lock_guard lk(mutex_);
+        Entry& e = entries_[file->path];
+        bool current = e.size == file->size && e.mtime == file->mtime;
+        if (current && e.manifest) {
+            ready = e.manifest;
+        }
+        else if (!e.waiting.empty()) {
+            // Already loading; if the file changed since, the new load
+            // started below answers everyone
+            e.waiting.push_back(std::move(handler));
+            if (current) return;
+            e.size = file->size;
+            e.mtime = file->mtime;
+            e.manifest = nullptr;
+        }
+        else {
+            e = Entry{ file->size, file->mtime, nullptr, {} };
+            e.waiting.push_back(std::move(handler));
+        }
+    }
+    if (ready) return handler(ready);
+
+    // Building one rereads the whole file, so keep it off the server's threads
+    std::thread([this, file]() {
+        ManifestPtr m = load_manifest(file->path, file->size, file->mtime);
+        if (!m) {
+            log_line(LogLevel::Info, "[Server] No current manifest for ", file->path, "; building one");
+            m = build_manifest(file->file, file->size);
+            if (m) save_manifest(file->path, *m);
+            else log_line(LogLevel::Error, "[Server] Could not hash ", file->path);
+        }
+
+        std::vector<Handler> waiting;
+        {
+            std::lock_guard lk(mutex_);
+            Entry& e = entries_[file->path];
+            if (e.size == file->size && e.mtime == file->mtime) {
+                e.manifest = m;
+                waiting.swap(e.waiting);
+            }
+        }
+        for (auto& h : waiting) h(m);
+    }).detach();
+}
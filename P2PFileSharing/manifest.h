@@ -0,0 +1,79 @@
+#pragma once
+#include "common.h"
+#include "file_cache.h"
+#include "sha256.h"
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+// What a shared file should contain: its size, the chunk size, the SHA-256
+// of every chunk and a root hash (the SHA-256 of the chunk hashes in order).
+// It is built when a file is shared and kept next to it as
+// <file>.p2pmanifest; peers fetch it with a MANIFEST request and check every
+// chunk they download against it.
+//
+// The encoding is the same on disk and on the wire: a short text header
+// followed by the chunk hashes.
+struct Manifest
+{
+    uint64_t filesize = 0;
+    uint32_t chunk_size = CHUNK_SIZE;
+    std::string hashes;        // 32 bytes per chunk, in chunk order
+    Sha256::Digest root{};
+
+    size_t chunks() const { return hashes.size() / Sha256::DIGEST_SIZE; }
+    const char* chunk_digest(size_t idx) const { return hashes.data() + idx * Sha256::DIGEST_SIZE; }
+
+    std::string encode() const;
+
+    // False unless `data` is a well-formed manifest whose hashes match its
+    // size and root
+    static bool decode(const std::string& data, Manifest& out);
+};
+
+using ManifestPtr = std::shared_ptr<const Manifest>;
+
+std::string manifest_path(const std::string& file_path);
+bool is_manifest_file(const std::filesystem::path& path);
+
+// Hashes the first `size` bytes of `file` on up to `threads` threads (0:
+// one per core); nullptr if the file can't be read
+ManifestPtr build_manifest(const FileHandle& file, uint64_t size, unsigned threads = 0);
+
+// Writes the manifest next to `file_path`, replacing any old one
+bool save_manifest(const std::string& file_path, const Manifest& m);
+
+// The manifest next to `file_path`, if there is one that describes a file
+// of `size` bytes and is not older than `mtime`
+ManifestPtr load_manifest(const std::string& file_path, uint64_t size, fs::file_time_type mtime);
+
+// Builds and saves the manifest of a file being shared; nullptr on error
+ManifestPtr make_manifest(const std::string& file_path);
+
+// Manifests of the files this peer serves, loaded (or, for a file shared
+// before manifests existed, built) on a background thread the first time a
+// file is requested. Requests that arrive meanwhile wait for the same
+// result. A manifest is kept until the file's size or mtime changes.
+class ManifestStore
+{
+public:
+    using Handler = std::function<void(ManifestPtr)>;
+
+    // Calls `handler` with the manifest (nullptr on a read error), either
+    // right away or from the background thread
+    void get(const std::shared_ptr<const CachedFile>& file, Handler handler);
+
+private:
+    struct Entry
+    {
+        uint64_t size = 0;
+        fs::file_time_type mtime;
+        ManifestPtr manifest;
+        std::vector<Handler> waiting;  // non-empty while loading
+    };
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;  // by path
+};
+
+extern ManifestStore manifests;
@@ -0,0 +1,59 @@
+#include "peer_health.h"
+
+namespace {
+
+constexpr double SCORE_WEIGHT = 0.2;
+constexpr unsigned TRIP_FAILURES = 3;
+constexpr unsigned MAX_TRIPS = 4;
+constexpr unsigned FORGIVE_SUCCESSES = 32;  // successes in a row that cancel one trip
+constexpr auto BACKOFF_BASE = std::chrono::milliseconds(250);
+constexpr auto OPEN_BASE = std::chrono::seconds(2);
+
+} // namespace
+
+PeerHealth::State PeerHealth::state(clock::time_point now) const
+{
+    if (removed_) return State::Removed;
+    if (!tripped_) return State::Closed;
+    return now < open_until_ ? State::Open : State::HalfOpen;
+}
+
+void PeerHealth::on_success()
+{
+    score_ = (1.0 - SCORE_WEIGHT) * score_ + SCORE_WEIGHT;
+    in_a_row_ = 0;
+    tripped_ = false;
+    if (trips_ > 0 && ++good_run_ >= FORGIVE_SUCCESSES) {
+        --trips_;
+        good_run_ = 0;
+    }
+}
+
+bool PeerHealth::on_failure(clock::time_point now)
+{
+    score_ = (1.0 - SCORE_WEIGHT) * score_;
+    ++failures_;
+    good_run_ = 0;
+    // Connections made before it tripped are still failing
+    State now_state = state(now);
+    if (now_state == State::Removed || now_state == State::Open) return false;
+
+    // A failed trial reopens the breaker straight away
+    bool trial = now_state == State::HalfOpen;
+    ++in_a_row_;
+    if (!trial && in_a_row_ < TRIP_FAILURES) return false;
+
+    tripped_ = true;
+    if (++trips_ >= MAX_TRIPS) {
+        removed_ = true;
+    }
+    else {
+        open_until_ = now + OPEN_BASE * (1 << (trips_ - 1));
+    }
+    return true;
+}
+
+PeerHealth::clock::duration PeerHealth::backoff() const
+{
+    return BACKOFF_BASE * (1 << std::min(in_a_row_ > 0 ? in_a_row_ - 1 : 0u, 4u));
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "common.h"
+#include <chrono>
+
+// How reliable a peer has been for one download. Every request that
+// succeeds or fails moves its score, an average of recent outcomes between
+// 0 and 1. A few failures in a row trip a circuit breaker: no connection is
+// made to the peer until the breaker's open period has passed, and that
+// period doubles each time it trips. After it one trial connection is
+// allowed; a success closes the breaker, a failure opens it again. A long
+// run of successes forgives one earlier trip. A peer that trips it too
+// often, or doesn't have the file, is removed.
+class PeerHealth
+{
+public:
+    using clock = std::chrono::steady_clock;
+    enum class State { Closed, Open, HalfOpen, Removed };
+
+    State state(clock::time_point now) const;
+    double score() const { return score_; }
+    size_t failures() const { return failures_; }
+
+    void on_success();
+
+    // True if this failure tripped the breaker
+    bool on_failure(clock::time_point now);
+
+    void remove() { removed_ = true; }
+
+    // How long to wait before reconnecting after a failure that didn't trip
+    // the breaker; doubles with each failure in a row
+    clock::duration backoff() const;
+
+private:
+    double score_ = 1.0;
+    size_t failures_ = 0;
+    unsigned in_a_row_ = 0;
+    unsigned trips_ = 0;
+    unsigned good_run_ = 0;  // successes since the last failure or forgiven trip
+    bool tripped_ = false;   // open or half-open until the next success
+    bool removed_ = false;
+    clock::time_point open_until_;
+};
@@ -0,0 +1,62 @@
+#include "protocol.h"
+
+namespace {
+
+void put_be(char* out, uint64_t v, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; --i) {
+        out[i] = static_cast<char>(v & 0xff);
+        v >>= 8;
+    }
+}
+
+uint64_t get_be(const char* in, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; ++i) v = (v << 8) | static_cast<unsigned char>(in[i]);
+    return v;
+}
+
+} // namespace
+
+void FrameHeader::encode(char* out) const
+{
+    out[0] = static_cast<char>(opcode);
+    out[1] = static_cast<char>(status);
+    out[2] = out[3] = 0;
+    put_be(out + 4, length, 4);
+    put_be(out + 8, index, 8);
+    put_be(out + 16, arg, 8);
+}
+
+FrameHeader FrameHeader::decode(const char* in)
+{
+    FrameHeader h;
+    h.opcode = static_cast<Opcode>(in[0]);
+    h.status = static_cast<Status>(in[1]);
+    h.length = static_cast<uint32_t>(get_be(in + 4, 4));
+    h.index = get_be(in + 8, 8);
+    h.arg = get_be(in + 16, 8);
+    return h;
+}
+
+const char* status_text(Status status)
+{
+    switch (status) {
+    case Status::Ok: return "ok";
+    case Status::NotFound: return "not found";
+    case Status::OutOfRange: return "out of range";
+    case Status::BadRequest: return "bad request";
+    case Status::ServerError: return "server error";
+    case Status::Choked: return "choked";
+    case Status::Throttled: return "throttled";
+    }
+    return "unknown status";
+}
+
+PeerStatusError::PeerStatusError(Status status, const std::string& message)
+    : std::runtime_error(std::string("peer error: ") + status_text(status) +
+        (message.empty() ? "" : " (" + message + ")")),
+      status_(status)
+{
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include "common.h"
+#include <cstdint>
+#include <stdexcept>
+
+// Peer wire protocol.
+//
+// Version 1 is the newline text protocol (FILESIZE, SENDCHUNK, RANGE, or a
+// bare file name). A client that sends "HELLO 2\n" and gets "HELLO 2\n"
+// back switches that connection to version 2: every request and response
+// is a fixed header followed by `length` payload bytes. Requests carry the
+// file name as payload; responses carry the data, or an error message when
+// status is not Ok. Errors no longer close the connection.
+//
+// Bitfield and Have let a peer that is still downloading a file seed the
+// chunks it already has: Bitfield returns which chunks it holds and a
+// version number, Have returns the chunks that arrived after a version.
+//
+// Manifest returns the file's manifest (size, chunk size, SHA-256 of every
+// chunk, root hash; see manifest.h) so a leecher can check each chunk as it
+// arrives. A peer still downloading the file relays the manifest it got
+// from its own source.
+//
+// A Chunk or Range request from a peer that is choked (see upload_slots.h)
+// is answered at once with an interim Choked header; the real reply to the
+// same request follows once the peer gets an upload slot. Likewise a reply
+// held back more than a moment by upload rate limits is announced with an
+// interim Throttled header whose arg is the expected delay in milliseconds.
+
+constexpr int PROTOCOL_VERSION = 2;
+constexpr size_t FRAME_HEADER_SIZE = 24;
+constexpr uint32_t MAX_REQUEST_PAYLOAD = 4096;  // longest file name accepted
+
+enum class Opcode : uint8_t
+{
+    FileSize = 1,  // response: arg = file size
+    Chunk = 2,     // index = chunk index
+    Range = 3,     // index = offset, arg = length
+    Bitfield = 4,  // response: index = chunk count, arg = version, payload = bitfield
+                   // (chunk 0 is the high bit of byte 0); no payload = has every chunk
+    Have = 5,      // index = version already seen; response: arg = new version,
+                   // payload = 8-byte chunk indices; index = 1 once it has every chunk
+    Manifest = 6,  // response: index = chunk count, payload = encoded Manifest
+};
+
+enum class Status : uint8_t
+{
+    Ok = 0,
+    NotFound = 1,
+    OutOfRange = 2,
+    BadRequest = 3,
+    ServerError = 4,
+    Choked = 5,     // interim, no payload: the reply follows after the unchoke
+    Throttled = 6,  // interim, no payload: the reply follows in about arg ms
+};
+
+// Header layout (all integers big-endian):
+//   0 opcode | 1 status | 2-3 reserved | 4-7 length | 8-15 index | 16-23 arg
+struct FrameHeader
+{
+    Opcode opcode = Opcode::FileSize;
+    Status status = Status::Ok;
+    uint32_t length = 0;
+    uint64_t index = 0;
+    uint64_t arg = 0;
+
+    void encode(char* out) const;
+    static FrameHeader decode(const char* in);
+};
+
+const char* status_text(Status status);
+
+// A peer's error status and message, as reported in logs and retry reasons.
+// The connection itself is still in sync and can carry more requests.
+class PeerStatusError : public std::runtime_error
+{
+public:
+    explicit PeerStatusError(Status status, const std::string& message);
+    Status status() const { return status_; }
+
+private:
+    Status status_;
+};
@@ -0,0 +1,51 @@
+#include "rate_limiter.h"
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+
+RateLimits rate_limits;
+
+std::chrono::nanoseconds TokenBucket::reserve(size_t bytes, uint64_t rate)
+{
+    if (rate == 0) return std::chrono::nanoseconds(0);
+
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t cost = static_cast<int64_t>(bytes * 1e9 / rate);
+    int64_t burst = std::chrono::duration_cast<std::chrono::nanoseconds>(BURST).count();
+
+    // drained_at is when everything reserved so far will have gone out at
+    // `rate`; callers may run up to one burst ahead of it
+    int64_t drained = drained_at_ns_.load(std::memory_order_relaxed);
+    int64_t next;
+    do {
+        next = std::max(drained, now) + cost;
+    } while (!drained_at_ns_.compare_exchange_weak(drained, next, std::memory_order_relaxed));
+
+    return std::chrono::nanoseconds(std::max<int64_t>(0, next - now - burst));
+}
+
+std::chrono::nanoseconds reserve_all(
+    std::initializer_list<std::pair<TokenBucket*, uint64_t>> levels, size_t bytes)
+{
+    std::chrono::nanoseconds wait(0);
+    for (const auto& [bucket, rate] : levels) wait = std::max(wait, bucket->reserve(bytes, rate));
+    return wait;
+}
+
+std::shared_ptr<TokenBucket> peer_download_bucket(const std::string& peer)
+{
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::weak_ptr<TokenBucket>> buckets;
+
+    std::lock_guard lk(mutex);
+    auto bucket = buckets[peer].lock();
+    if (bucket) return bucket;
+    for (auto it = buckets.begin(); it != buckets.end();) {
+        if (it->second.expired()) it = buckets.erase(it);
+        else ++it;
+    }
+    bucket = std::make_shared<TokenBucket>();
+    buckets[peer] = bucket;
+    return bucket;
+}
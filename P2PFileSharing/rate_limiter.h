@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <utility>
+
+// Lock-free token bucket in its "virtual clock" form: instead of counting
+// tokens it tracks when the reserved bytes will have drained at the given
+// rate, so a reservation is one clock read and one CAS. The rate is passed
+// on each call so limits can change at runtime without touching buckets.
+class TokenBucket
+{
+public:
+    // Reserves `bytes` at `rate` bytes/sec (0 = unlimited) and returns how
+    // long the caller should wait before sending them. Up to BURST worth of
+    // traffic goes through without waiting after an idle period.
+    std::chrono::nanoseconds reserve(size_t bytes, uint64_t rate);
+
+    static constexpr std::chrono::milliseconds BURST{ 250 };
+
+private:
+    std::atomic<int64_t> drained_at_ns_{ 0 };
+};
+
+// Byte rates (bytes/sec, 0 = unlimited) for each level of the hierarchy.
+// Uploads are limited globally and per peer IP; downloads globally, per
+// download and per peer, however many connections that peer is spread over. All of them can be changed while running.
+struct RateLimits
+{
+    std::atomic<uint64_t> global_upload{ 0 };
+    std::atomic<uint64_t> peer_upload{ 0 };
+    std::atomic<uint64_t> global_download{ 0 };
+    std::atomic<uint64_t> per_download{ 0 };
+    std::atomic<uint64_t> peer_download{ 0 };
+
+    TokenBucket upload_bucket;
+    TokenBucket download_bucket;
+};
+
+extern RateLimits rate_limits;
+
+// Reserves `bytes` in every (bucket, rate) level and returns the longest wait
+std::chrono::nanoseconds reserve_all(
+    std::initializer_list<std::pair<TokenBucket*, uint64_t>> levels, size_t bytes);
+
+// The peer_download bucket for `peer` ("ip:port"), shared by every
+// connection to it while any of them holds it
+std::shared_ptr<TokenBucket> peer_download_bucket(const std::string& peer);
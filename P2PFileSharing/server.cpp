@@ -1,130 +1,672 @@
-
 #include "server.h"
-#include "common.h"               
+#include "common.h"
+#include "file_cache.h"
+#include "local_chunks.h"
+#include "logger.h"
+#include "manifest.h"
+#include "protocol.h"
+#include "rate_limiter.h"
+#include <array>
+#include <limits>
+
+ServerStats server_stats;
+ChunkCache chunk_cache;
+UploadSlots upload_slots;
+
+namespace {
+
+constexpr auto STATS_INTERVAL = std::chrono::seconds(5);
+constexpr auto RECHOKE_INTERVAL = std::chrono::seconds(10);
+
+// Rate-limit waits at least this long are announced to framed clients
+constexpr auto THROTTLE_NOTICE = std::chrono::seconds(1);
 
+// Open descriptors and metadata shared by every session
+FileCache file_cache;
 
-void run_server(unsigned short port)
+constexpr size_t NOT_A_CHUNK = static_cast<size_t>(-1);
+
+// A partial download reports and serves against its final size: the cached
+// size of a file that is still growing may lag behind the chunks it holds
+uint64_t full_size(const CachedFile& file)
 {
-    try {
-        boost::asio::io_context io;
-        tcp::acceptor acceptor(io, tcp::endpoint(tcp::v4(), port));
-        {
-            std::lock_guard<std::mutex> lock(cout_mutex);
-            std::cout << "[Server] Listening on port " << port << "...\n";
-        }
-        while (true) {
-            tcp::socket sock(io);
-            acceptor.accept(sock);
-            boost::asio::streambuf buf;
-            boost::asio::read_until(sock, buf, "\n");
-            std::string line;
-            std::getline(std::istream(&buf), line);
-            std::istringstream iss(line);
-            std::string cmd; iss >> cmd;
-
-            auto resolve = [&](const std::string& fn) {
-                // 1) Always serve the real file in shared_files/
-                std::filesystem::path shared = std::filesystem::path("shared_files") / fn;
-                if (std::filesystem::exists(shared)) return shared.string();
-
-                // 2) Maybe its a downloaded file (for Leecher)
-                std::filesystem::path dl = std::filesystem::path("downloads") / fn;
-                if (std::filesystem::exists(dl)) return dl.string();
-
-                // 3) Check current folder (fallback)
-                if (std::filesystem::exists(fn)) return fn;
-
-                // 4) Otherwise, return where the Leecher would put it
-                return dl.string();
-                };
-
-
-            if (cmd == "FILESIZE") {
-                std::string fn; iss >> fn;
-                std::string path = resolve(fn);
-                size_t sz = std::filesystem::exists(path) ?
-                    std::filesystem::file_size(path) : 0;
-                boost::asio::write(sock, boost::asio::buffer(std::to_string(sz) + "\n"));
-                std::lock_guard<std::mutex> lock(cout_mutex);
-                std::cout << "[Server] FILESIZE " << fn << ": " << sz << " bytes\n";
-            }
-            else if (cmd == "SENDCHUNK") {
-                std::string fn; size_t idx;
-                iss >> fn >> idx;
-                std::string path = resolve(fn);
-
-                try {
-                    std::ifstream f(path, std::ios::binary);
-                    if (!f) {
-                        std::lock_guard<std::mutex> lock(cout_mutex);
-                        std::cerr << "[Server] File not found: " << path << "\n";
-                        continue;
-                    }
+    uint64_t size = file.size;
+    local_chunks.partial_size(file.path, size);
+    return size;
+}
 
-                    // Get file size to check boundaries
-                    f.seekg(0, std::ios::end);
-                    size_t file_size = f.tellg();
+void log_sent(size_t idx, uint64_t offset, size_t n)
+{
+    if (idx != NOT_A_CHUNK) ++server_stats.chunks_served;
+    server_stats.bytes_served += n;
 
-                    // Calculate chunk info
-                    size_t offset = idx * CHUNK_SIZE;
-                    if (offset >= file_size) {
-                        std::lock_guard<std::mutex> lock(cout_mutex);
-                        std::cerr << "[Server] Chunk index " << idx << " out of bounds for " << path << "\n";
-                        continue;
-                    }
+    if (idx != NOT_A_CHUNK)
+        log_line(LogLevel::Debug, "[Server] Sent chunk ", idx, " (", n, " bytes)");
+    else
+        log_line(LogLevel::Debug, "[Server] Sent range ", offset, "+", n);
+}
 
-                    // Calculate actual chunk size (may be less for last chunk)
-                    size_t actual_chunk_size = std::min(CHUNK_SIZE, file_size - offset);
+// One accepted connection. Every step is an async operation so a slow
+// reader only holds its own socket, never a worker thread.
+//
+// Connections start in the text protocol: FILESIZE, SENDCHUNK and RANGE keep
+// the connection open for the next command, while errors and full-file
+// transfers close it. "HELLO 2" switches the connection to framed requests
+// (see protocol.h), where errors get an explicit status reply instead.
+// Pipelined requests wait in buf_ and are answered strictly in order.
+// Data requests first need an upload slot; a choked connection's request
+// stays parked until upload_slots unchokes it. Each session's handlers run
+// on its own strand, since a parked session reads and waits at once.
+class Session : public std::enable_shared_from_this<Session>
+{
+public:
+    explicit Session(tcp::socket sock) : sock_(std::move(sock)), throttle_(sock_.get_executor())
+    {
+        ++server_stats.active_connections;
+    }
 
-                    // Read the chunk
-                    f.seekg(offset, std::ios::beg);
-                    if (!f) {
-                        std::lock_guard<std::mutex> lock(cout_mutex);
-                        std::cerr << "[Server] Seek error to position " << offset << " in " << path << "\n";
-                        continue;
-                    }
+    ~Session()
+    {
+        if (slot_) upload_slots.leave(slot_, this);
+        --server_stats.active_connections;
+    }
 
-                    std::vector<char> chunk(actual_chunk_size);
-                    f.read(chunk.data(), actual_chunk_size);
-                    size_t got = f.gcount();
+    void start()
+    {
+        boost::system::error_code ec;
+        auto remote = sock_.remote_endpoint(ec);
+        slot_ = upload_slots.join(ec ? std::string() : remote.address().to_string());
+        read_command();
+    }
 
-                    if (got != actual_chunk_size) {
-                        std::lock_guard<std::mutex> lock(cout_mutex);
-                        std::cerr << "[Server] Read error: expected " << actual_chunk_size
-                            << " but got " << got << " bytes\n";
-                    }
+private:
+    // Runs `serve` once this connection holds an upload slot. A choked
+    // framed request gets an interim Choked header right away, so the client
+    // knows the wait is not a dead peer; the reply follows after the unchoke.
+    void with_slot(std::function<void()> serve)
+    {
+        auto self = shared_from_this();
+        bool now = upload_slots.acquire(slot_, this, [self]() {
+            boost::asio::post(self->sock_.get_executor(), [self]() {
+                self->unchoked_ = true;
+                self->resume_parked();
+            });
+        });
+        if (now) return serve();
 
-                    // Send the chunk
-                    boost::asio::write(sock, boost::asio::buffer(chunk.data(), got));
+        parked_ = std::move(serve);
+        unchoked_ = false;
+        watch_parked();
+        if (binary_) send_notice(Status::Choked, 0, [self]() { self->resume_parked(); });
+    }
+
+    // Interim header for the request being answered: its reply is held back
+    void send_notice(Status status, uint64_t arg, std::function<void()> next)
+    {
+        FrameHeader h = request_;
+        h.status = status;
+        h.length = 0;
+        h.arg = arg;
+        h.encode(notice_);
+        notice_pending_ = true;
+        auto self = shared_from_this();
+        boost::asio::async_write(sock_, boost::asio::buffer(notice_),
+            [self, next](const boost::system::error_code& ec, size_t) {
+                self->notice_pending_ = false;
+                if (!ec) next();
+            });
+    }
 
-                    std::lock_guard<std::mutex> lock(cout_mutex);
-                    std::cout << "[Server] Sent chunk " << idx << " (" << got << " bytes)\n";
+    // Keeps reading while parked (later requests just wait in buf_), so a
+    // client that hangs up leaves the upload queue instead of holding its place
+    void watch_parked()
+    {
+        watching_ = true;
+        auto self = shared_from_this();
+        boost::asio::async_read(sock_, buf_, boost::asio::transfer_at_least(1),
+            [self](const boost::system::error_code& ec, size_t) {
+                self->watching_ = false;
+                if (ec && ec != boost::asio::error::operation_aborted) {
+                    self->parked_ = nullptr;
+                    upload_slots.withdraw(self->slot_, self.get());
+                    return;
                 }
-                catch (const std::exception& e) {
-                    std::lock_guard<std::mutex> lock(cout_mutex);
-                    std::cerr << "[Server] Error sending chunk " << idx << ": " << e.what() << "\n";
+                if (self->unchoked_) self->resume_parked();
+                else self->watch_parked();
+            });
+    }
+
+    // Serves the parked request once it is unchoked and nothing else is
+    // outstanding on the socket
+    void resume_parked()
+    {
+        if (!parked_ || !unchoked_ || notice_pending_) return;
+        if (watching_) {
+            // The watch read comes back here once cancelled
+            boost::system::error_code ignored;
+            sock_.cancel(ignored);
+            return;
+        }
+        auto serve = std::move(parked_);
+        parked_ = nullptr;
+        serve();
+    }
+
+    void next_request()
+    {
+        if (binary_) read_frame();
+        else read_command();
+    }
+
+    // Version 1: one newline-terminated command
+    void read_command()
+    {
+        auto self = shared_from_this();
+        boost::asio::async_read_until(sock_, buf_, "\n",
+            [self](const boost::system::error_code& ec, size_t) {
+                if (ec) return;
+                std::string line;
+                std::getline(std::istream(&self->buf_), line);
+                self->handle_command(line);
+            });
+    }
+
+    void handle_command(const std::string& line)
+    {
+        std::istringstream iss(line);
+        std::string cmd; iss >> cmd;
+
+        if (cmd == "HELLO") {
+            // Version handshake; anything we don't speak stays on text
+            int version = 0; iss >> version;
+            bool upgrade = version == PROTOCOL_VERSION;
+            reply_ = "HELLO " + std::to_string(upgrade ? PROTOCOL_VERSION : 1) + "\n";
+            auto self = shared_from_this();
+            boost::asio::async_write(sock_, boost::asio::buffer(reply_),
+                [self, upgrade](const boost::system::error_code& ec, size_t) {
+                    if (ec) return;
+                    self->binary_ = upgrade;
+                    self->next_request();
+                });
+        }
+        else if (cmd == "FILESIZE") {
+            std::string fn; iss >> fn;
+            send_filesize(fn);
+        }
+        else if (cmd == "SENDCHUNK") {
+            std::string fn; size_t idx = 0;
+            iss >> fn >> idx;
+            with_slot([self = shared_from_this(), fn, idx]() { self->send_chunk(fn, idx); });
+        }
+        else if (cmd == "RANGE") {
+            // RANGE <file> <offset> <length>: the reply is exactly
+            // min(length, filesize - offset) bytes
+            std::string fn; uint64_t offset = 0, length = 0;
+            iss >> fn >> offset >> length;
+            with_slot([self = shared_from_this(), fn, offset, length]() { self->send_range(fn, offset, length); });
+        }
+        else {
+            with_slot([self = shared_from_this(), cmd]() { self->send_full_file(cmd); });
+        }
+    }
+
+    // Calls `next` once buf_ holds at least `n` bytes
+    template <typename Next>
+    void fill(size_t n, Next next)
+    {
+        if (buf_.size() >= n) return next();
+        auto self = shared_from_this();
+        boost::asio::async_read(sock_, buf_, boost::asio::transfer_at_least(n - buf_.size()),
+            [self, n, next](const boost::system::error_code& ec, size_t) {
+                if (ec) return;
+                self->fill(n, next);
+            });
+    }
+
+    // Version 2: one framed request
+    void read_frame()
+    {
+        auto self = shared_from_this();
+        fill(FRAME_HEADER_SIZE, [self]() {
+            char raw[FRAME_HEADER_SIZE];
+            boost::asio::buffer_copy(boost::asio::buffer(raw), self->buf_.data());
+            FrameHeader h = FrameHeader::decode(raw);
+            if (h.length > MAX_REQUEST_PAYLOAD) {
+                log_line(LogLevel::Warn, "[Server] Oversized request (", h.length, " bytes), closing");
+                return;
+            }
+
+            self->fill(FRAME_HEADER_SIZE + h.length, [self, h]() {
+                self->buf_.consume(FRAME_HEADER_SIZE);
+                std::string fn(h.length, '\0');
+                boost::asio::buffer_copy(boost::asio::buffer(&fn[0], fn.size()), self->buf_.data());
+                self->buf_.consume(h.length);
+                self->request_ = h;
+
+                switch (h.opcode) {
+                case Opcode::FileSize: self->send_filesize(fn); break;
+                case Opcode::Chunk:
+                    self->with_slot([self, fn, h]() { self->send_chunk(fn, static_cast<size_t>(h.index)); });
+                    break;
+                case Opcode::Range:
+                    self->with_slot([self, fn, h]() { self->send_range(fn, h.index, h.arg); });
+                    break;
+                case Opcode::Bitfield: self->send_bitfield(fn); break;
+                case Opcode::Have: self->send_have(fn, h.index); break;
+                case Opcode::Manifest: self->send_manifest(fn); break;
+                default: self->fail(Status::BadRequest, "unknown opcode"); break;
                 }
+            });
+        });
+    }
+
+    // Text connections are closed on error; framed ones get a status reply
+    // and stay open
+    void fail(Status status, const std::string& message)
+    {
+        log_line(LogLevel::Warn, "[Server] ", message);
+        if (!binary_) return;
+
+        FrameHeader h = request_;
+        h.status = status;
+        h.length = static_cast<uint32_t>(std::min<size_t>(message.size(), MAX_REQUEST_PAYLOAD));
+        reply_ = std::string(FRAME_HEADER_SIZE, '\0') + message.substr(0, h.length);
+        h.encode(&reply_[0]);
+
+        auto self = shared_from_this();
+        boost::asio::async_write(sock_, boost::asio::buffer(reply_),
+            [self](const boost::system::error_code& ec, size_t) {
+                if (!ec) self->next_request();
+            });
+    }
+
+    void send_filesize(const std::string& fn)
+    {
+        auto file = file_cache.get(fn);
+        uint64_t sz = file ? full_size(*file) : 0;
+        log_line(LogLevel::Info, "[Server] FILESIZE ", fn, ": ", sz, " bytes");
+        if (binary_) {
+            FrameHeader h = request_;
+            h.length = 0;
+            h.arg = sz;
+            reply_.assign(FRAME_HEADER_SIZE, '\0');
+            h.encode(&reply_[0]);
+        }
+        else {
+            reply_ = std::to_string(sz) + "\n";
+        }
+        auto self = shared_from_this();
+        boost::asio::async_write(sock_, boost::asio::buffer(reply_),
+            [self](const boost::system::error_code& ec, size_t) {
+                if (!ec) self->next_request();
+            });
+    }
+
+    void send_chunk(const std::string& fn, size_t idx)
+    {
+        file_ = file_cache.get(fn);
+        if (!file_) return fail(Status::NotFound, "File not found: " + FileCache::resolve(fn));
+        uint64_t size = full_size(*file_);
+
+        // Calculate chunk info
+        uint64_t offset = static_cast<uint64_t>(idx) * CHUNK_SIZE;
+        if (offset >= size) {
+            return fail(Status::OutOfRange, "Chunk index " + std::to_string(idx) +
+                " out of bounds for " + file_->path);
+        }
+
+        if (!local_chunks.has(file_->path, idx)) {
+            return fail(Status::NotFound, "Chunk " + std::to_string(idx) + " of " + file_->path +
+                " not downloaded yet");
+        }
+
+        // Calculate actual chunk size (may be less for last chunk)
+        size_t actual_chunk_size = static_cast<size_t>(std::min<uint64_t>(CHUNK_SIZE, size - offset));
+        send_data(idx, offset, actual_chunk_size);
+    }
+
+    void send_range(const std::string& fn, uint64_t offset, uint64_t length)
+    {
+        file_ = file_cache.get(fn);
+        if (!file_) return fail(Status::NotFound, "File not found: " + FileCache::resolve(fn));
+        uint64_t size = full_size(*file_);
+
+        if (offset >= size || length == 0) {
+            return fail(Status::OutOfRange, "Range " + std::to_string(offset) + "+" +
+                std::to_string(length) + " out of bounds for " + file_->path);
+        }
+
+        size_t len = static_cast<size_t>(std::min<uint64_t>(length, size - offset));
+        if (binary_ && len > std::numeric_limits<uint32_t>::max()) {
+            // The reply header's length field couldn't describe it
+            return fail(Status::BadRequest, "Range " + std::to_string(offset) + "+" +
+                std::to_string(length) + " too long for one reply");
+        }
+        for (uint64_t c = offset / CHUNK_SIZE; c <= (offset + len - 1) / CHUNK_SIZE; ++c) {
+            if (!local_chunks.has(file_->path, static_cast<size_t>(c))) {
+                return fail(Status::NotFound, "Range " + std::to_string(offset) + "+" +
+                    std::to_string(len) + " of " + file_->path + " not downloaded yet");
             }
-            else {
-                std::string fn = cmd;
-                std::string path = resolve(fn);
-                std::ifstream f(path, std::ios::binary);
-                size_t total = 0;
-                if (f) {
-                    std::vector<char> chunk(CHUNK_SIZE);
-                    while (f.read(chunk.data(), CHUNK_SIZE) || f.gcount() > 0) {
-                        size_t n = f.gcount();
-                        total += n;
-                        boost::asio::write(sock, boost::asio::buffer(chunk.data(), n));
+        }
+
+        // A range that is exactly one chunk can still be served from the chunk cache
+        bool whole_chunk = offset % CHUNK_SIZE == 0 &&
+            len == std::min<uint64_t>(CHUNK_SIZE, size - offset);
+        send_data(whole_chunk ? static_cast<size_t>(offset / CHUNK_SIZE) : NOT_A_CHUNK, offset, len);
+    }
+
+    // Which chunks we hold; empty payload for a complete file
+    void send_bitfield(const std::string& fn)
+    {
+        auto file = file_cache.get(fn);
+        if (!file) return fail(Status::NotFound, "File not found: " + FileCache::resolve(fn));
+        uint64_t size = full_size(*file);
+
+        std::string bits;
+        FrameHeader h = request_;
+        h.index = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        h.arg = 0;
+        local_chunks.bitfield(file->path, bits, h.arg);
+        send_reply(h, bits);
+    }
+
+    // Chunks that arrived since the client's last Bitfield/Have
+    void send_have(const std::string& fn, uint64_t since)
+    {
+        auto file = file_cache.get(fn);
+        if (!file) return fail(Status::NotFound, "File not found: " + FileCache::resolve(fn));
+
+        std::vector<uint64_t> chunks;
+        FrameHeader h = request_;
+        h.index = 0;
+        h.arg = since;
+        if (!local_chunks.added_since(file->path, since, chunks, h.arg)) h.index = 1;
+
+        std::string payload(chunks.size() * 8, '\0');
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            for (int b = 0; b < 8; ++b)
+                payload[i * 8 + b] = static_cast<char>(chunks[i] >> (56 - 8 * b));
+        }
+        send_reply(h, payload);
+    }
+
+    // Complete files are served the manifest written when they were shared
+    // (loaded off this thread); partial downloads relay the one they are
+    // checked against.
+    void send_manifest(const std::string& fn)
+    {
+        auto file = file_cache.get(fn);
+        if (!file) return fail(Status::NotFound, "File not found: " + FileCache::resolve(fn));
+
+        FrameHeader h = request_;
+        h.index = (full_size(*file) + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        uint64_t partial;
+        if (local_chunks.partial_size(file->path, partial)) {
+            ManifestPtr m = local_chunks.manifest(file->path);
+            if (!m) return fail(Status::NotFound, "No manifest for " + file->path);
+            return send_reply(h, m->encode());
+        }
+
+        auto self = shared_from_this();
+        manifests.get(file, [self, h, path = file->path](ManifestPtr m) {
+            boost::asio::post(self->sock_.get_executor(), [self, h, path, m]() {
+                if (!m) return self->fail(Status::ServerError, "Could not hash " + path);
+                self->send_reply(h, m->encode());
+            });
+        });
+    }
+
+    void send_reply(FrameHeader h, const std::string& payload)
+    {
+        h.status = Status::Ok;
+        h.length = static_cast<uint32_t>(payload.size());
+        reply_.assign(FRAME_HEADER_SIZE, '\0');
+        h.encode(&reply_[0]);
+        reply_ += payload;
+
+        auto self = shared_from_this();
+        boost::asio::async_write(sock_, boost::asio::buffer(reply_),
+            [self](const boost::system::error_code& ec, size_t) {
+                if (!ec) self->next_request();
+            });
+    }
+
+    // Sends [offset, offset + len) of file_ once the global and per-peer
+    // upload limits allow it
+    void send_data(size_t idx, uint64_t offset, size_t len)
+    {
+        auto wait = reserve_all({
+            { &rate_limits.upload_bucket, rate_limits.global_upload.load() },
+            { &slot_->bucket, rate_limits.peer_upload.load() } }, len);
+        if (wait.count() == 0) return transmit(idx, offset, len);
+
+        auto self = shared_from_this();
+        auto wait_out = [self, idx, offset, len, until = std::chrono::steady_clock::now() + wait]() {
+            self->throttle_.expires_at(until);
+            self->throttle_.async_wait([self, idx, offset, len](const boost::system::error_code& ec) {
+                if (!ec) self->transmit(idx, offset, len);
+            });
+        };
+        // A long wait is announced so the client doesn't take it for a dead peer
+        if (binary_ && wait >= THROTTLE_NOTICE) {
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(wait).count();
+            return send_notice(Status::Throttled, static_cast<uint64_t>(ms), wait_out);
+        }
+        wait_out();
+    }
+
+    // Writes the response (behind a header on framed connections); `idx`
+    // names the chunk when the range is exactly one chunk so popular chunks
+    // come from memory
+    void transmit(size_t idx, uint64_t offset, size_t len)
+    {
+        size_t header_len = 0;
+        if (binary_) {
+            FrameHeader h = request_;
+            h.length = static_cast<uint32_t>(len);
+            h.encode(header_);
+            header_len = FRAME_HEADER_SIZE;
+        }
+
+        if (idx == NOT_A_CHUNK) return send_body(idx, offset, len, header_len, nullptr);
+        auto self = shared_from_this();
+        chunk_cache.get(file_, idx, offset, len, sock_.get_executor(),
+            [self, idx, offset, len, header_len](ChunkData data) {
+                self->send_body(idx, offset, len, header_len, std::move(data));
+            });
+    }
+
+    // Sends the prepared header and the payload, from `data` when the chunk
+    // cache had it and zero-copy from the file otherwise
+    void send_body(size_t idx, uint64_t offset, size_t len, size_t header_len, ChunkData data)
+    {
+        auto self = shared_from_this();
+        if (data) {
+            std::array<boost::asio::const_buffer, 2> bufs = {
+                boost::asio::buffer(header_, header_len), boost::asio::buffer(*data)
+            };
+            boost::asio::async_write(sock_, bufs,
+                [self, idx, offset, data, header_len](const boost::system::error_code& ec, size_t n) {
+                    if (ec) {
+                        log_line(LogLevel::Error, "[Server] Error sending chunk ", idx, ": ", ec.message());
+                        return;
+                    }
+                    upload_slots.on_sent(*self->slot_, n);
+                    log_sent(idx, offset, n - header_len);
+                    self->next_request();
+                });
+            return;
+        }
+
+        auto send_file = [self, idx, offset, len]() {
+            async_send_file_range(self->sock_, self->file_->file, offset, len,
+                [self, idx, offset, len](const boost::system::error_code& ec, size_t n) {
+                    if (ec || n != len) {
+                        // A short reply would desync the next request on this connection
+                        log_line(LogLevel::Error, "[Server] Error sending ", offset, "+", len, ": ",
+                            ec ? ec.message() : "short read");
+                        return;
+                    }
+                    upload_slots.on_sent(*self->slot_, n);
+                    log_sent(idx, offset, n);
+                    self->next_request();
+                });
+        };
+
+        if (header_len == 0) return send_file();
+        boost::asio::async_write(sock_, boost::asio::buffer(header_, header_len),
+            [send_file](const boost::system::error_code& ec, size_t) {
+                if (!ec) send_file();
+            });
+    }
+
+    void send_full_file(const std::string& fn)
+    {
+        file_ = file_cache.get(fn);
+        if (!file_) {
+            log_line(LogLevel::Info, "[Server] Sent full file: ", fn, " (0 bytes)");
+            return;
+        }
+
+        // A download still in progress has holes; this reply can't say so
+        uint64_t size = 0;
+        if (local_chunks.partial_size(file_->path, size)) {
+            log_line(LogLevel::Warn, "[Server] Refusing full file ", fn, ": still downloading");
+            return;
+        }
+
+        send_file_block(fn, 0);
+    }
+
+    // Full-file transfers are legacy, but still pay for the upload limits
+    // one block at a time like any other reply
+    void send_file_block(const std::string& fn, uint64_t offset)
+    {
+        size_t len = static_cast<size_t>(std::min<uint64_t>(CHUNK_SIZE, file_->size - offset));
+        if (len == 0) {
+            log_line(LogLevel::Info, "[Server] Sent full file: ", fn, " (", offset, " bytes)");
+            return;
+        }
+
+        auto wait = reserve_all({
+            { &rate_limits.upload_bucket, rate_limits.global_upload.load() },
+            { &slot_->bucket, rate_limits.peer_upload.load() } }, len);
+        auto self = shared_from_this();
+        throttle_.expires_after(wait);
+        throttle_.async_wait([self, fn, offset, len](const boost::system::error_code& ec) {
+            if (ec) return;
+            async_send_file_range(self->sock_, self->file_->file, offset, len,
+                [self, fn, offset, len](const boost::system::error_code& ec, size_t n) {
+                    server_stats.bytes_served += n;
+                    if (ec || n != len) {
+                        log_line(LogLevel::Error, "[Server] Error sending full file ", fn, " at ", offset, ": ",
+                            ec ? ec.message() : "short read");
+                        return;
                     }
+                    upload_slots.on_sent(*self->slot_, n);
+                    self->send_file_block(fn, offset + n);
+                });
+        });
+    }
+
+    tcp::socket sock_;
+    boost::asio::steady_timer throttle_;  // waits out upload rate limits
+    boost::asio::streambuf buf_;
+    bool binary_ = false;      // switched on by a "HELLO 2" handshake
+    FrameHeader request_;      // request being answered on a framed connection
+    char notice_[FRAME_HEADER_SIZE];  // interim Choked/Throttled header
+    char header_[FRAME_HEADER_SIZE];
+    std::string reply_;
+    std::shared_ptr<const CachedFile> file_;  // keeps the descriptor open while sending
+    std::shared_ptr<UploadPeer> slot_;
+    std::function<void()> parked_;  // request waiting for an upload slot
+    bool unchoked_ = false;
+    bool watching_ = false;
+    bool notice_pending_ = false;
+};
+
+void do_accept(tcp::acceptor& acceptor)
+{
+    acceptor.async_accept(boost::asio::make_strand(acceptor.get_executor()),
+        [&acceptor](const boost::system::error_code& ec, tcp::socket sock) {
+        if (!ec) {
+            std::make_shared<Session>(std::move(sock))->start();
+        }
+        else {
+            log_line(LogLevel::Error, "[Server] Accept error: ", ec.message());
+        }
+        do_accept(acceptor);
+        });
+}
+
+// Re-ranks upload slots every RECHOKE_INTERVAL
+void schedule_rechoke(boost::asio::steady_timer& timer)
+{
+    timer.expires_after(RECHOKE_INTERVAL);
+    timer.async_wait([&timer](const boost::system::error_code& ec) {
+        if (ec) return;
+        upload_slots.rechoke(RECHOKE_INTERVAL);
+        if (upload_slots.queued_count() > 0) {
+            log_line(LogLevel::Info, "[Server] Rechoke: ", upload_slots.unchoked_count(), " unchoked, ",
+                upload_slots.queued_count(), " queued");
+        }
+        schedule_rechoke(timer);
+        });
+}
+
+// Periodically turns the raw counters into rates for logs and the UI
+void schedule_stats(boost::asio::steady_timer& timer, uint64_t last_chunks, uint64_t last_bytes)
+{
+    timer.expires_after(STATS_INTERVAL);
+    timer.async_wait([&timer, last_chunks, last_bytes](const boost::system::error_code& ec) {
+        if (ec) return;
+        uint64_t chunks = server_stats.chunks_served.load();
+        uint64_t bytes = server_stats.bytes_served.load();
+        double secs = std::chrono::duration<double>(STATS_INTERVAL).count();
+        server_stats.chunks_per_sec = (chunks - last_chunks) / secs;
+        server_stats.bytes_per_sec = (bytes - last_bytes) / secs;
+
+        if (chunks != last_chunks) {
+            log_line(LogLevel::Info, "[Server] ", server_stats.chunks_per_sec.load(), " chunks/sec, ",
+                server_stats.bytes_per_sec.load() / (1024.0 * 1024.0), " MB/s, ",
+                server_stats.active_connections.load(), " connections, chunk cache ",
+                chunk_cache.hits(), " hits / ", chunk_cache.misses(), " misses");
+        }
+        schedule_stats(timer, chunks, bytes);
+        });
+}
+
+} // namespace
+
+
+void run_server(unsigned short port, size_t threads)
+{
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    try {
+        boost::asio::io_context io(static_cast<int>(threads));
+        tcp::acceptor acceptor(io, tcp::endpoint(tcp::v4(), port));
+        boost::asio::steady_timer stats_timer(io);
+        boost::asio::steady_timer rechoke_timer(io);
+        log_line(LogLevel::Info, "[Server] Listening on port ", port,
+            " with ", threads, " worker threads...");
+
+        do_accept(acceptor);
+        schedule_stats(stats_timer, 0, 0);
+        schedule_rechoke(rechoke_timer);
+
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&io]() {
+                try { io.run(); }
+                catch (const std::exception& e) {
+                    log_line(LogLevel::Error, "[Server] Worker error: ", e.what());
                 }
-                std::lock_guard<std::mutex> lock(cout_mutex);
-                std::cout << "[Server] Sent full file: " << fn << " (" << total << " bytes)\n";
-            }
+                });
         }
+        for (auto& th : workers) th.join();
     }
     catch (const std::exception& e) {
-        std::lock_guard<std::mutex> lock(cout_mutex);
-        std::cerr << "[Server] Error: " << e.what() << "\n";
+        log_line(LogLevel::Error, "[Server] Error: ", e.what());
     }
 }
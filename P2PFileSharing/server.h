@@ -1,2 +1,24 @@
 #pragma once
-void run_server(unsigned short port);
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include "chunk_cache.h"
+#include "upload_slots.h"
+
+// Counters shared between the server worker threads and the UI
+struct ServerStats
+{
+    std::atomic<uint64_t> chunks_served{ 0 };
+    std::atomic<uint64_t> bytes_served{ 0 };
+    std::atomic<uint64_t> active_connections{ 0 };
+    std::atomic<double> chunks_per_sec{ 0.0 };  // refreshed by the stats timer
+    std::atomic<double> bytes_per_sec{ 0.0 };
+};
+
+extern ServerStats server_stats;
+extern ChunkCache chunk_cache;  // hot chunks shared by all server workers
+extern UploadSlots upload_slots;
+
+// Serves peers on `port` using an io_context driven by `threads` workers
+// (0 = one per hardware thread). Blocks until the server stops.
+void run_server(unsigned short port, size_t threads = 0);
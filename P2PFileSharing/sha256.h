@@ -0,0 +1,34 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Incremental SHA-256 (FIPS 180-4). Small enough to copy, so a partly
+// hashed chunk can be kept and resumed later.
+class Sha256
+{
+public:
+    static constexpr size_t DIGEST_SIZE = 32;
+    using Digest = std::array<uint8_t, DIGEST_SIZE>;
+
+    Sha256();
+
+    void update(const void* data, size_t len);
+    Digest finish();
+
+    // Bytes hashed so far
+    uint64_t length() const { return length_; }
+
+    static Digest digest(const void* data, size_t len);
+
+private:
+    void block(const uint8_t* p);
+
+    uint32_t state_[8];
+    uint8_t buf_[64];
+    size_t buffered_ = 0;
+    uint64_t length_ = 0;
+};
+
+std::string to_hex(const uint8_t* data, size_t len);
@@ -1,5 +1,11 @@
 #include "tracker_client.h"
 
+namespace {
+
+// The tracker answers from memory, so a slow reply means it is unreachable
+constexpr auto TRACKER_TIMEOUT = std::chrono::seconds(5);
+
+} // namespace
 
 
 bool register_file_with_tracker(const std::string& tracker_ip,
@@ -8,18 +14,10 @@ bool register_file_with_tracker(const std::string& tracker_ip,
     const std::string& my_ip,
     unsigned short my_port) {
     try {
-        boost::asio::io_context io;
-        tcp::socket sock(io);
-        sock.connect({ boost::asio::ip::make_address(tracker_ip), tracker_port });
-        std::string msg = "REGISTER " + filename + " " + my_ip +
-            " " + std::to_string(my_port) + "\n";
-        boost::asio::write(sock, boost::asio::buffer(msg));
-        boost::asio::streambuf resp;
-        boost::asio::read_until(sock, resp, "\n");
-        std::istream is(&resp);
-        std::string line;
-        std::getline(is, line);
-        return (line == "OK");
+        TimedConnection conn(TRACKER_TIMEOUT);
+        conn.connect(tracker_ip, tracker_port);
+        conn.write("REGISTER " + filename + " " + my_ip + " " + std::to_string(my_port) + "\n");
+        return conn.read_line() == "OK";
     }
     catch (...) {
         return false;
@@ -43,17 +41,10 @@ std::vector<std::string> get_peers_from_tracker(const std::string& tracker_ip,un
 {
     std::vector<std::string> peers;
     try {
-        boost::asio::io_context io;
-        tcp::socket sock(io);
-        sock.connect({ boost::asio::ip::make_address(tracker_ip), tracker_port });
-        std::string msg = "GETPEERS " + filename + "\n";
-        boost::asio::write(sock, boost::asio::buffer(msg));
-        boost::asio::streambuf resp;
-        boost::asio::read_until(sock, resp, "\n");
-        std::istream is(&resp);
-        std::string line;
-        std::getline(is, line);
-        std::stringstream ss(line);
+        TimedConnection conn(TRACKER_TIMEOUT);
+        conn.connect(tracker_ip, tracker_port);
+        conn.write("GETPEERS " + filename + "\n");
+        std::stringstream ss(conn.read_line());
         std::string peer;
         while (std::getline(ss, peer, ';')) {
             if (!peer.empty()) peers.push_back(peer);
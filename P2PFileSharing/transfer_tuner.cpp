@@ -0,0 +1,88 @@
+#include "transfer_tuner.h"
+#include <cmath>
+
+PipelineTuner::PipelineTuner(size_t fixed_depth, size_t max_depth)
+    : fixed_(fixed_depth), max_(std::max<size_t>(max_depth, 1)),
+      depth_(fixed_depth ? fixed_depth : 2)
+{
+}
+
+void PipelineTuner::on_response(double latency_sec, size_t bytes, double interval_sec)
+{
+    if (min_rtt_ == 0.0 || latency_sec < min_rtt_) min_rtt_ = latency_sec;
+    latency_ = latency_ == 0.0 ? latency_sec : 0.8 * latency_ + 0.2 * latency_sec;
+
+    double sample = bytes / std::max(interval_sec, 1e-6);
+    rate_ = rate_ == 0.0 ? sample : 0.8 * rate_ + 0.2 * sample;
+
+    if (fixed_) return;
+
+    // Enough requests to cover one RTT at the current rate, plus one queued
+    // behind them so the link never waits for the next request to arrive.
+    double bdp_chunks = rate_ * min_rtt_ / CHUNK_SIZE;
+    size_t want = static_cast<size_t>(std::ceil(bdp_chunks)) + 1;
+    depth_ = std::clamp<size_t>(want, 2, max_);
+}
+
+namespace {
+
+// A connection needs a couple of round trips and a few chunks before its
+// pipeline is full, so a change is judged on the interval after next
+constexpr unsigned SETTLE_INTERVALS = 2;
+constexpr unsigned HOLD_INTERVALS = 10;
+constexpr double MIN_GAIN = 0.1;
+
+} // namespace
+
+ConnectionTuner::ConnectionTuner(size_t fixed_count, size_t initial, size_t max_count)
+    : fixed_(fixed_count), max_(std::max<size_t>(max_count, 1)),
+      target_(std::clamp<size_t>(fixed_count ? fixed_count : initial, 1, max_)),
+      settle_(SETTLE_INTERVALS)
+{
+}
+
+void ConnectionTuner::set_max(size_t max_count)
+{
+    max_ = std::max<size_t>(max_count, 1);
+    target_ = std::min(target_, max_);
+}
+
+void ConnectionTuner::on_interval(double rate, size_t failures)
+{
+    if (fixed_) return;
+
+    if (failures > 0) {
+        target_ = std::max<size_t>(1, target_ - std::max<size_t>(1, target_ / 4));
+        before_probe_ = 0;
+        settle_ = SETTLE_INTERVALS;
+        hold_ = HOLD_INTERVALS;
+        return;
+    }
+    if (settle_ > 0) {
+        --settle_;
+        return;
+    }
+
+    if (before_probe_) {
+        if (rate < base_rate_ * (1.0 + MIN_GAIN)) {
+            // The extra connections didn't pay for themselves
+            target_ = before_probe_;
+            before_probe_ = 0;
+            settle_ = SETTLE_INTERVALS;
+            hold_ = HOLD_INTERVALS;
+            return;
+        }
+        before_probe_ = 0;
+    }
+    if (hold_ > 0) {
+        --hold_;
+        return;
+    }
+
+    if (target_ < max_) {
+        before_probe_ = target_;
+        base_rate_ = rate;
+        target_ = std::min(max_, target_ + std::max<size_t>(1, target_ / 2));
+        settle_ = SETTLE_INTERVALS;
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include "common.h"
+
+// Decides how many requests to keep outstanding on one connection. A fixed
+// depth is used as-is; depth 0 sizes the pipeline to the bandwidth-delay
+// product measured from the responses (min RTT x delivery rate).
+class PipelineTuner
+{
+public:
+    explicit PipelineTuner(size_t fixed_depth, size_t max_depth = 32);
+
+    size_t depth() const { return depth_; }
+    double rtt() const { return min_rtt_; }
+    double latency() const { return latency_; }
+    double rate() const { return rate_; }
+
+    // latency: request sent -> first response byte
+    // interval: time since the previous response completed (or since sent)
+    void on_response(double latency_sec, size_t bytes, double interval_sec);
+
+private:
+    size_t fixed_;
+    size_t max_;
+    size_t depth_;
+    double min_rtt_ = 0.0;
+    double latency_ = 0.0;  // seconds, EWMA
+    double rate_ = 0.0;     // bytes/sec, EWMA
+};
+
+// Decides how many connections a download keeps open. Every interval the
+// download reports its aggregate rate and how many requests failed. While
+// below the limit the tuner probes upwards, adding half again as many
+// connections; a probe that raises the rate by at least a tenth is kept
+// and the next one starts, one that doesn't is rolled back and probing
+// pauses. Failures shed a quarter of the connections. A fixed count is
+// used as-is.
+class ConnectionTuner
+{
+public:
+    ConnectionTuner(size_t fixed_count, size_t initial, size_t max_count);
+
+    size_t target() const { return target_; }
+
+    // Lowers or raises the limit, e.g. as other downloads start and finish
+    void set_max(size_t max_count);
+
+    void on_interval(double rate, size_t failures);
+
+private:
+    size_t fixed_;
+    size_t max_;
+    size_t target_;
+    size_t before_probe_ = 0;  // target the running probe started from; 0 if none
+    double base_rate_ = 0.0;   // rate at before_probe_
+    unsigned settle_ = 0;      // intervals to skip while new connections ramp up
+    unsigned hold_ = 0;        // intervals before the next probe
+};
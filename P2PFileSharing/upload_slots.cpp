@@ -0,0 +1,193 @@
+#include "upload_slots.h"
+#include <random>
+
+namespace {
+
+constexpr unsigned OPTIMISTIC_EVERY = 3;  // rounds between optimistic rotations
+
+std::mutex received_mutex;
+std::unordered_map<std::string, uint64_t> received_from;  // bytes this round, by ip
+
+} // namespace
+
+void record_download_from(const std::string& ip, size_t bytes)
+{
+    std::lock_guard lk(received_mutex);
+    received_from[ip] += bytes;
+}
+
+UploadSlots::UploadSlots(size_t max_unchoked) : max_(max_unchoked)
+{
+}
+
+std::shared_ptr<UploadPeer> UploadSlots::join(const std::string& ip)
+{
+    std::lock_guard lk(mutex_);
+    auto it = std::find_if(peers_.begin(), peers_.end(), [&](const auto& p) { return !ip.empty() && p->ip == ip; });
+    if (it != peers_.end()) {
+        ++(*it)->connections;
+        return *it;
+    }
+    auto peer = std::make_shared<UploadPeer>();
+    peer->ip = ip;
+    peer->connections = 1;
+    peers_.push_back(peer);
+    return peer;
+}
+
+void UploadSlots::leave(const std::shared_ptr<UploadPeer>& peer, const void* conn)
+{
+    std::vector<std::function<void()>> resumes, dropped;
+    {
+        std::lock_guard lk(mutex_);
+        auto it = std::find(peers_.begin(), peers_.end(), peer);
+        if (it == peers_.end()) return;
+        withdraw_locked(*peer, conn, dropped);
+        if (--peer->connections > 0) return;
+        if (peer->unchoked) --unchoked_;
+        peers_.erase(it);
+        fill_slots_locked(resumes);
+    }
+    for (auto& r : resumes) r();
+}
+
+bool UploadSlots::acquire(const std::shared_ptr<UploadPeer>& peer, const void* conn, std::function<void()> resume)
+{
+    std::lock_guard lk(mutex_);
+    peer->last_request = std::chrono::steady_clock::now();
+    if (max_ == 0 || peer->unchoked) return true;
+
+    if (unchoked_ < max_ && queued_ == 0) {
+        peer->unchoked = true;
+        ++unchoked_;
+        return true;
+    }
+
+    if (peer->waiting.empty()) {
+        peer->queued_since = peer->last_request;
+        ++queued_;
+    }
+    peer->waiting.emplace_back(conn, std::move(resume));
+    return false;
+}
+
+void UploadSlots::withdraw(const std::shared_ptr<UploadPeer>& peer, const void* conn)
+{
+    std::vector<std::function<void()>> dropped;
+    std::lock_guard lk(mutex_);
+    withdraw_locked(*peer, conn, dropped);
+}
+
+// Moves `conn`'s parked requests into `dropped`, to be destroyed outside the
+// lock since they may hold the last reference to their connection
+void UploadSlots::withdraw_locked(UploadPeer& peer, const void* conn, std::vector<std::function<void()>>& dropped)
+{
+    if (peer.waiting.empty()) return;
+    auto& w = peer.waiting;
+    auto mine = std::stable_partition(w.begin(), w.end(), [&](const auto& e) { return e.first != conn; });
+    for (auto it = mine; it != w.end(); ++it) dropped.push_back(std::move(it->second));
+    w.erase(mine, w.end());
+    if (w.empty()) --queued_;
+}
+
+// Marks `peer` unchoked and hands back every request it has parked
+void UploadSlots::unchoke_locked(UploadPeer& peer, std::vector<std::function<void()>>& resumes)
+{
+    if (!peer.unchoked) ++unchoked_;
+    peer.unchoked = true;
+    if (peer.waiting.empty()) return;
+    --queued_;
+    for (auto& [conn, resume] : peer.waiting) resumes.push_back(std::move(resume));
+    peer.waiting.clear();
+}
+
+void UploadSlots::set_max_unchoked(size_t n)
+{
+    std::vector<std::function<void()>> resumes;
+    {
+        std::lock_guard lk(mutex_);
+        max_ = n;
+        fill_slots_locked(resumes);
+    }
+    for (auto& r : resumes) r();
+}
+
+void UploadSlots::fill_slots_locked(std::vector<std::function<void()>>& resumes)
+{
+    // Longest-waiting choked peers first
+    while (queued_ > 0 && (max_ == 0 || unchoked_ < max_)) {
+        std::shared_ptr<UploadPeer> next;
+        for (auto& p : peers_) {
+            if (!p->waiting.empty() && !p->unchoked && (!next || p->queued_since < next->queued_since))
+                next = p;
+        }
+        if (!next) break;
+        unchoke_locked(*next, resumes);
+    }
+}
+
+void UploadSlots::rechoke(std::chrono::steady_clock::duration round)
+{
+    std::unordered_map<std::string, uint64_t> received;
+    {
+        std::lock_guard lk(received_mutex);
+        received.swap(received_from);
+    }
+
+    std::vector<std::function<void()>> resumes;
+    {
+        std::lock_guard lk(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        double secs = std::max(std::chrono::duration<double>(round).count(), 1e-3);
+        for (auto& p : peers_) p->upload_rate = p->sent_in_round.exchange(0) / secs;
+
+        if (max_ == 0) return;
+
+        // Interested = asked for data this round or is waiting for a slot
+        std::vector<std::shared_ptr<UploadPeer>> interested;
+        for (auto& p : peers_) {
+            if (!p->waiting.empty() || now - p->last_request < round) interested.push_back(p);
+        }
+
+        auto reciprocation = [&](const UploadPeer& p) {
+            auto it = received.find(p.ip);
+            return it == received.end() ? 0 : it->second;
+        };
+        std::stable_sort(interested.begin(), interested.end(), [&](const auto& a, const auto& b) {
+            uint64_t ra = reciprocation(*a), rb = reciprocation(*b);
+            if (ra != rb) return ra > rb;
+            return a->upload_rate > b->upload_rate;
+        });
+
+        size_t max = max_;
+        size_t regular = max > 1 ? max - 1 : max;
+        std::vector<std::shared_ptr<UploadPeer>> keep(interested.begin(),
+            interested.begin() + std::min(regular, interested.size()));
+
+        // Keep the optimistic slot for a few rounds, then hand it to a random
+        // choked peer so newcomers can earn a regular slot
+        bool rotate = ++round_ % OPTIMISTIC_EVERY == 0;
+        std::shared_ptr<UploadPeer> optimistic;
+        for (auto& p : interested) {
+            if (p->optimistic && !rotate) optimistic = p;
+        }
+        if (!optimistic && interested.size() > keep.size()) {
+            static std::mt19937 rng{ std::random_device{}() };
+            std::uniform_int_distribution<size_t> pick(keep.size(), interested.size() - 1);
+            optimistic = interested[pick(rng)];
+        }
+        if (optimistic && std::find(keep.begin(), keep.end(), optimistic) == keep.end() && keep.size() < max_)
+            keep.push_back(optimistic);
+
+        unchoked_ = 0;
+        for (auto& p : peers_) {
+            p->unchoked = false;
+            p->optimistic = false;
+            if (std::find(keep.begin(), keep.end(), p) == keep.end()) continue;
+            p->optimistic = p == optimistic;
+            unchoke_locked(*p, resumes);
+        }
+        fill_slots_locked(resumes);
+    }
+    for (auto& r : resumes) r();
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include "common.h"
+#include "rate_limiter.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+
+// Upload bookkeeping for one peer, shared by all of its connections
+struct UploadPeer
+{
+    std::string ip;
+    size_t connections = 0;
+    bool unchoked = false;
+    bool optimistic = false;
+    // Requests parked while choked, one per waiting connection
+    std::vector<std::pair<const void*, std::function<void()>>> waiting;
+    std::chrono::steady_clock::time_point queued_since;
+    std::chrono::steady_clock::time_point last_request;
+    std::atomic<uint64_t> sent_in_round{ 0 };
+    double upload_rate = 0.0;  // bytes/sec we sent them last round
+    TokenBucket bucket;        // per-peer upload limit
+};
+
+// Upload slot manager for the seeder (BitTorrent-style choking).
+//
+// At most `max_unchoked` peers are served at a time; requests from the rest
+// are parked in arrival order until a slot frees up. A peer is keyed by IP,
+// so opening more connections doesn't buy it more slots or bandwidth. Every
+// rechoke round the regular slots go to the interested peers that upload
+// the most to us (reciprocation), ties broken by how fast they take our
+// data; one extra slot rotates optimistically so newcomers get a chance
+// to prove themselves. max_unchoked = 0 disables choking.
+class UploadSlots
+{
+public:
+    explicit UploadSlots(size_t max_unchoked = 8);
+
+    // A connection from `ip` opened or closed; `conn` identifies it
+    std::shared_ptr<UploadPeer> join(const std::string& ip);
+    void leave(const std::shared_ptr<UploadPeer>& peer, const void* conn);
+
+    // True if the peer may be sent to now; otherwise `resume` is stored and
+    // called (from another thread) once the peer is unchoked
+    bool acquire(const std::shared_ptr<UploadPeer>& peer, const void* conn, std::function<void()> resume);
+
+    // Drops the request `conn` has parked, if any
+    void withdraw(const std::shared_ptr<UploadPeer>& peer, const void* conn);
+
+    void on_sent(UploadPeer& peer, size_t bytes) { peer.sent_in_round += bytes; }
+
+    // Re-ranks peers; call every `round` (10s is the usual choice)
+    void rechoke(std::chrono::steady_clock::duration round);
+
+    void set_max_unchoked(size_t n);
+    size_t max_unchoked() const { return max_; }
+    size_t unchoked_count() const { return unchoked_; }
+    size_t queued_count() const { return queued_; }
+
+private:
+    void fill_slots_locked(std::vector<std::function<void()>>& resumes);
+    void unchoke_locked(UploadPeer& peer, std::vector<std::function<void()>>& resumes);
+    void withdraw_locked(UploadPeer& peer, const void* conn, std::vector<std::function<void()>>& dropped);
+
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<UploadPeer>> peers_;
+    std::atomic<size_t> max_;
+    std::atomic<size_t> unchoked_{ 0 };
+    std::atomic<size_t> queued_{ 0 };  // peers with parked requests
+    unsigned round_ = 0;
+};
+
+// Bytes our downloads received from `ip`; drives reciprocation in rechoke()
+void record_download_from(const std::string& ip, size_t bytes);
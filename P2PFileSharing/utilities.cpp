@@ -21,73 +21,64 @@ unsigned short find_free_port()
     return acceptor.local_endpoint().port();
 }
 
-bool verify_file_integrity(const std::string& filename, size_t expected_size)
+std::pair<std::string, unsigned short> split_peer(const std::string& peer)
 {
-    try {
-        std::ifstream file(filename, std::ios::binary);
-        if (!file) {
-            std::cerr << "Cannot open file for verification: " << filename << "\n";
-            return false;
-        }
-
-        // Check file size
-        file.seekg(0, std::ios::end);
-        size_t size = file.tellg();
-        if (size != expected_size) {
-            std::cerr << "File size mismatch: expected " << expected_size
-                << ", got " << size << "\n";
-            return false;
-        }
+    auto pos = peer.find(':');
+    return std::make_pair(peer.substr(0, pos),
+        static_cast<unsigned short>(std::stoi(peer.substr(pos + 1))));
+}
 
-        // Read entire file to check for corruption
-        file.seekg(0, std::ios::beg);
-        std::vector<char> buffer(4096);
-        size_t total_read = 0;
+TimedConnection::TimedConnection(std::chrono::steady_clock::duration timeout)
+    : sock_(io_), timer_(io_), deadline_(std::chrono::steady_clock::now() + timeout)
+{
+}
 
-        while (file) {
-            file.read(buffer.data(), buffer.size());
-            size_t read_count = file.gcount();
-            if (read_count == 0) break;
+void TimedConnection::connect(const std::string& ip, unsigned short port)
+{
+    boost::system::error_code result = boost::asio::error::would_block;
+    sock_.async_connect({ boost::asio::ip::make_address(ip), port },
+        [&](const boost::system::error_code& ec) { result = ec; });
+    wait(result, std::min(deadline_, std::chrono::steady_clock::now() + CONNECT_TIMEOUT));
+}
 
-            // Check for blocks of zeros or other patterns that might indicate corruption
-            bool all_zeros = true;
-            for (size_t i = 0; i < read_count; i++) {
-                if (buffer[i] != 0) {
-                    all_zeros = false;
-                    break;
-                }
-            }
+void TimedConnection::write(const std::string& data)
+{
+    boost::system::error_code result = boost::asio::error::would_block;
+    boost::asio::async_write(sock_, boost::asio::buffer(data),
+        [&](const boost::system::error_code& ec, size_t) { result = ec; });
+    wait(result, deadline_);
+}
 
-            if (all_zeros && read_count == buffer.size()) {
-                std::cerr << "Warning: Found block of all zeros at offset "
-                    << total_read << "\n";
-            }
+std::string TimedConnection::read_line()
+{
+    boost::system::error_code result = boost::asio::error::would_block;
+    size_t n = 0;
+    boost::asio::async_read_until(sock_, boost::asio::dynamic_buffer(buf_), '\n',
+        [&](const boost::system::error_code& ec, size_t got) { result = ec; n = got; });
+    wait(result, deadline_);
+    std::string line = buf_.substr(0, n - 1);
+    buf_.erase(0, n);
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    return line;
+}
 
-            total_read += read_count;
-        }
+void TimedConnection::wait(boost::system::error_code& result, std::chrono::steady_clock::time_point deadline)
+{
+    // Closing the socket completes the pending operation with an error
+    bool expired = false;
+    timer_.expires_at(deadline);
+    timer_.async_wait([&](const boost::system::error_code& ec) {
+        if (ec) return;
+        expired = true;
+        boost::system::error_code ignored;
+        sock_.close(ignored);
+    });
 
-        std::cout << "File integrity verified: " << filename
-            << " (" << total_read << " bytes)\n";
-        return true;
-    }
-    catch (const std::exception& e) {
-        std::cerr << "Error verifying file: " << e.what() << "\n";
-        return false;
-    }
-}
+    io_.restart();
+    while (result == boost::asio::error::would_block && io_.run_one()) {}
+    timer_.cancel();
+    io_.run();
 
-size_t get_filesize_from_peer(const std::string& ip,unsigned short port,const std::string& filename) {
-    try {
-        boost::asio::io_context io;
-        tcp::socket sock(io);
-        sock.connect({ boost::asio::ip::make_address(ip), port });
-        std::string msg = "FILESIZE " + filename + "\n";
-        boost::asio::write(sock, boost::asio::buffer(msg));
-        boost::asio::streambuf buf;
-        boost::asio::read_until(sock, buf, "\n");
-        std::string line;
-        std::getline(std::istream(&buf), line);
-        return std::stoull(line);
-    }
-    catch (...) { return 0; }
+    if (expired) throw boost::system::system_error(boost::asio::error::timed_out);
+    if (result) throw boost::system::system_error(result);
 }
@@ -1,7 +1,35 @@
 #pragma once
+#include "common.h"
 #include <string>
+#include <utility>
 
 std::string get_local_ip();
 unsigned short find_free_port();
-bool verify_file_integrity(const std::string& filename, size_t expected_size);
-size_t get_filesize_from_peer(const std::string& ip,unsigned short port,const std::string& filename);
\ No newline at end of file
+
+// Splits a tracker peer entry "ip:port" into its parts
+std::pair<std::string, unsigned short> split_peer(const std::string& peer);
+
+// A short request/response exchange for code that wants to block, run on
+// async operations so nothing waits on the OS timeouts. The connect has to
+// finish within CONNECT_TIMEOUT and the whole exchange within `timeout`;
+// an operation that misses its deadline throws boost::system::system_error
+// with error::timed_out, as do other errors.
+class TimedConnection
+{
+public:
+    explicit TimedConnection(std::chrono::steady_clock::duration timeout);
+
+    void connect(const std::string& ip, unsigned short port);
+    void write(const std::string& data);
+    std::string read_line();
+
+private:
+    // Runs the io_context until `result` is set or `deadline` passes
+    void wait(boost::system::error_code& result, std::chrono::steady_clock::time_point deadline);
+
+    boost::asio::io_context io_;
+    tcp::socket sock_;
+    boost::asio::steady_timer timer_;
+    std::chrono::steady_clock::time_point deadline_;
+    std::string buf_;
+};